@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Times building a K3Tree over points sampled from the surface of an ellipsoid with each
+ * thread count from 1 up to the given maximum (doubling), reporting the median of several
+ * builds and the speedup over one thread. The trees built with more threads are checked to
+ * answer queries the same as the tree built with one.
+ *
+ * Usage: K3TreeBuildBench [numPoints=2000000] [maxThreads=hardware threads] [leafSize=16] [reps=5]
+ */
+#include <K3Tree.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+using rNonRigid::K3Tree;
+using rNonRigid::MatX3f;
+using rNonRigid::MatXi;
+using rNonRigid::MatXf;
+using rNonRigid::Vec3f;
+
+
+namespace {
+
+MatX3f ellipsoidPoints( size_t n, unsigned seed)
+{
+    std::mt19937 rng( seed);
+    std::normal_distribution<float> nd( 0.0f, 1.0f);
+    const Vec3f radii( 80.0f, 100.0f, 60.0f);
+    MatX3f pts( n, 3);
+    for ( size_t i = 0; i < n; ++i)
+    {
+        const Vec3f v( nd(rng), nd(rng), nd(rng));
+        pts.row(i) = v.normalized().cwiseProduct( radii).transpose();
+    }   // end for
+    return pts;
+}   // end ellipsoidPoints
+
+
+double buildSeconds( const MatX3f &pts, size_t leafSize, size_t nthreads, size_t reps)
+{
+    std::vector<double> secs;
+    for ( size_t r = 0; r < reps; ++r)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        const K3Tree tree( pts, leafSize, nthreads);
+        secs.push_back( std::chrono::duration<double>( std::chrono::steady_clock::now() - t0).count());
+    }   // end for
+    std::sort( secs.begin(), secs.end());
+    return secs[secs.size()/2];
+}   // end buildSeconds
+
+}   // end namespace
+
+
+int main( int argc, char **argv)
+{
+    const size_t N = argc > 1 ? size_t( std::atol( argv[1])) : 2000000;
+    const size_t hw = std::max<size_t>( std::thread::hardware_concurrency(), 1);
+    const size_t maxThreads = argc > 2 ? size_t( std::atol( argv[2])) : hw;
+    const size_t leafSize = argc > 3 ? size_t( std::atol( argv[3])) : 16;
+    const size_t reps = argc > 4 ? std::max<size_t>( size_t( std::atol( argv[4])), 1) : 5;
+
+    const MatX3f pts = ellipsoidPoints( N, 1);
+    const MatX3f qry = ellipsoidPoints( 10000, 2);
+    std::printf( "%zu points, leaf size %zu, %zu hardware threads, median of %zu builds\n", N, leafSize, hw, reps);
+    std::printf( "threads  build (s)  speedup  same queries\n");
+
+    MatXi idxs1, idxs;
+    MatXf sqd1, sqd;
+    K3Tree( pts, leafSize, 1).findn( qry, 8, idxs1, sqd1);
+    double t1 = 0.0;
+    for ( size_t nt = 1; nt <= maxThreads; nt *= 2)
+    {
+        const double t = buildSeconds( pts, leafSize, nt, reps);
+        if ( nt == 1)
+            t1 = t;
+        K3Tree( pts, leafSize, nt).findn( qry, 8, idxs, sqd);
+        std::printf( "%7zu  %9.3f  %7.2f  %s\n", nt, t, t1 / t, idxs == idxs1 && sqd == sqd1 ? "yes" : "NO");
+    }   // end for
+    return EXIT_SUCCESS;
+}   // end main
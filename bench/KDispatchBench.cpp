@@ -0,0 +1,184 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Times the kernels dispatched on the neighbour count (see KDispatch.h) with a count they're
+ * specialised for against the generic fallback, over points sampled from the surface of an
+ * ellipsoid. The fallback is timed with the next count up that isn't specialised (e.g. 81 for
+ * 80) so times are reported per neighbour visited to compare them. The kernels timed are the
+ * regularisation sweeps and the outlier diffusion of ViscoElasticTransformer (with the given
+ * smoothing neighbour count) and the search and affinities of KNNCorresponder (with the given
+ * correspondence neighbour count). The cost of a search isn't proportional to the count so
+ * counts just below the next one up compare best. Each time is the median of several runs.
+ *
+ * Usage: KDispatchBench [numPoints=200000] [smoothK=80] [corrK=8] [numThreads=1] [reps=5]
+ */
+#include <KDispatch.h>
+#include <K3Tree.h>
+#include <KNNCorresponder.h>
+#include <ViscoElasticTransformer.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+using rNonRigid::dispatchK;
+using rNonRigid::EllAffinity;
+using rNonRigid::K3Tree;
+using rNonRigid::KNNCorresponder;
+using rNonRigid::MatX3f;
+using rNonRigid::SmoothingWeights;
+using rNonRigid::Vec3f;
+using rNonRigid::VecXf;
+using rNonRigid::ViscoElasticTransformer;
+
+
+namespace {
+
+constexpr size_t SWEEPS = 10;       // Viscous and elastic sweeps of each update
+constexpr size_t DIFFUSIONS = 50;   // Outlier diffusion steps of each update
+
+MatX3f ellipsoidPoints( size_t n, unsigned seed)
+{
+    std::mt19937 rng( seed);
+    std::normal_distribution<float> nd( 0.0f, 1.0f);
+    const Vec3f radii( 80.0f, 100.0f, 60.0f);
+    MatX3f pts( n, 3);
+    for ( size_t i = 0; i < n; ++i)
+    {
+        const Vec3f v( nd(rng), nd(rng), nd(rng));
+        pts.row(i) = v.normalized().cwiseProduct( radii).transpose();
+    }   // end for
+    return pts;
+}   // end ellipsoidPoints
+
+
+bool isSpecialised( size_t k)
+{
+    bool s = false;
+    dispatchK( k, [&]( auto fk){ s = decltype(fk)::value > 0;});
+    return s;
+}   // end isSpecialised
+
+
+// Returns the lowest count above k dispatched to the generic kernels.
+size_t genericK( size_t k)
+{
+    do { ++k;} while ( isSpecialised( k));
+    return k;
+}   // end genericK
+
+
+template <typename Fn>
+double medianSeconds( size_t reps, Fn &&fn)
+{
+    std::vector<double> secs;
+    for ( size_t r = 0; r < reps; ++r)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        secs.push_back( std::chrono::duration<double>( std::chrono::steady_clock::now() - t0).count());
+    }   // end for
+    std::sort( secs.begin(), secs.end());
+    return secs[secs.size()/2];
+}   // end medianSeconds
+
+
+// Returns the median seconds of an update over the given smoothing weights with every
+// vertex given the inlier weight iwt and the given number of outlier diffusion steps.
+double updateSeconds( const SmoothingWeights &swts, float iwt, size_t nodi, size_t nthreads, size_t reps)
+{
+    const size_t N = size_t( swts.indices().rows());
+    ViscoElasticTransformer vet( swts, SWEEPS, SWEEPS, SWEEPS, SWEEPS, 100, 0.8f, nodi, nthreads);
+    const VecXf iwts = VecXf::Constant( N, iwt);
+    MatX3f df = MatX3f::Constant( N, 3, 1.0f);
+    vet.update( df, iwts);  // Sizes the workspace
+    return medianSeconds( reps, [&](){ vet.update( df, iwts);});
+}   // end updateSeconds
+
+
+struct Timings
+{
+    double sweep;       // Nanoseconds per neighbour visited by a regularisation sweep
+    double diffuse;     // Nanoseconds per neighbour visited by an outlier diffusion step
+    double affinity;    // Nanoseconds per neighbour found for the affinities
+};  // end struct
+
+
+Timings timeKernels( const MatX3f &pts, const K3Tree &tree, const MatX3f &qry,
+                     size_t smoothK, size_t corrK, size_t nthreads, size_t reps)
+{
+    const double N = double( pts.rows());
+    const SmoothingWeights swts( tree, smoothK, 5.0f, nthreads);
+
+    // Updates with all inliers only regularise (two relaxations of SWEEPS sweeps). Making
+    // every vertex an outlier (below the threshold of 0.8) adds the diffusion steps which
+    // are separated by the difference.
+    const double tsweep = updateSeconds( swts, 1.0f, DIFFUSIONS, nthreads, reps);
+    const double tboth = updateSeconds( swts, 0.5f, DIFFUSIONS, nthreads, reps);
+
+    const KNNCorresponder knn( rNonRigid::viewOf( qry), corrK, nthreads);
+    EllAffinity A;
+    knn.affinities( tree, A, false);
+    const double taff = medianSeconds( reps, [&](){ knn.affinities( tree, A, false);});
+
+    Timings t;
+    t.sweep = 1e9 * tsweep / (2 * SWEEPS * N * smoothK);
+    t.diffuse = 1e9 * std::max( tboth - tsweep, 0.0) / (DIFFUSIONS * N * smoothK);
+    t.affinity = 1e9 * taff / (double( qry.rows()) * corrK);
+    return t;
+}   // end timeKernels
+
+
+void printRow( const char *kernel, size_t k, double tk, size_t g, double tg)
+{
+    std::printf( "%-10s  %4zu  %9.3f  %4zu  %9.3f  %7.2f\n", kernel, k, tk, g, tg, tg / tk);
+}   // end printRow
+
+}   // end namespace
+
+
+int main( int argc, char **argv)
+{
+    const size_t N = argc > 1 ? size_t( std::atol( argv[1])) : 200000;
+    const size_t smoothK = argc > 2 ? size_t( std::atol( argv[2])) : 80;
+    const size_t corrK = argc > 3 ? size_t( std::atol( argv[3])) : 8;
+    const size_t nthreads = argc > 4 ? std::max<size_t>( size_t( std::atol( argv[4])), 1) : 1;
+    const size_t reps = argc > 5 ? std::max<size_t>( size_t( std::atol( argv[5])), 1) : 5;
+
+    if ( !isSpecialised( smoothK) || !isSpecialised( corrK))
+    {
+        std::fprintf( stderr, "smoothK and corrK must be counts the kernels are specialised for (see KDispatch.h)\n");
+        return EXIT_FAILURE;
+    }   // end if
+
+    const MatX3f pts = ellipsoidPoints( N, 1);
+    const MatX3f qry = ellipsoidPoints( N, 2);
+    const K3Tree tree( pts, 16, nthreads);
+    const size_t smoothG = genericK( smoothK);
+    const size_t corrG = genericK( corrK);
+
+    std::printf( "%zu points, %zu threads, median of %zu runs, nanoseconds per neighbour\n", N, nthreads, reps);
+    std::printf( "kernel         K  dispatched     K    generic  speedup\n");
+    const Timings tk = timeKernels( pts, tree, qry, smoothK, corrK, nthreads, reps);
+    const Timings tg = timeKernels( pts, tree, qry, smoothG, corrG, nthreads, reps);
+    printRow( "regularise", smoothK, tk.sweep, smoothG, tg.sweep);
+    printRow( "diffuse", smoothK, tk.diffuse, smoothG, tg.diffuse);
+    printRow( "affinity", corrK, tk.affinity, corrG, tg.affinity);
+    return EXIT_SUCCESS;
+}   // end main
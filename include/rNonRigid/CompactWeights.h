@@ -0,0 +1,97 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_COMPACT_WEIGHTS_H
+#define RNONRIGID_COMPACT_WEIGHTS_H
+
+/**
+ * A copy of SmoothingWeights in half the memory that ViscoElasticTransformer can read in place of
+ * them, so the weights it was made from can be freed once it's made. Weights are quantised to
+ * 16 bits relative to the largest weight in their row. The neighbour indices of each block of
+ * BLOCK_ROWS rows are held as 16 bit offsets from the smallest index in the block, which needs
+ * the neighbours of the block's vertices to span fewer than 2^16 vertices. That holds when the
+ * vertices are ordered so that near vertices have near indices; blocks where it doesn't keep
+ * their indices at full width. Rows are decoded on the fly into caller buffers.
+ */
+#include "SmoothingWeights.h"
+#include "KDispatch.h"
+#include <cstdint>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT CompactWeights
+{
+public:
+    static const size_t BLOCK_ROWS = 64;
+
+    explicit CompactWeights( const SmoothingWeights&);
+
+    inline size_t rows() const { return _scale.size();}
+    inline size_t cols() const { return _K;}
+
+    // Decode the neighbour indices and weights of row i into nidxs and wts (cols() elements each).
+    // Specialised for FK neighbours (see KDispatch.h).
+    template <size_t FK>
+    inline void decode( size_t i, int *nidxs, float *wts) const
+    {
+        const size_t K = numK<FK>( _K);
+        const uint16_t *q = &_qwts[i*K];
+        const float s = _scale[i];
+        for ( size_t k = 0; k < K; ++k)
+            wts[k] = s * float(q[k]);
+
+        const size_t blk = i / BLOCK_ROWS;
+        const size_t off = _start[blk] + (i - blk*BLOCK_ROWS)*K;
+        const int base = _base[blk];
+        if ( base >= 0)
+        {
+            const uint16_t *d = &_deltas[off];
+            for ( size_t k = 0; k < K; ++k)
+                nidxs[k] = base + int(d[k]);
+        }   // end if
+        else
+        {
+            const int *w = &_wide[off];
+            for ( size_t k = 0; k < K; ++k)
+                nidxs[k] = w[k];
+        }   // end else
+    }   // end decode
+
+    // Returns the number of blocks keeping full width indices.
+    size_t numWideBlocks() const;
+
+    // Returns the number of bytes used to store the weights and indices.
+    size_t bytes() const;
+
+    // Returns the largest absolute difference between a decoded weight and the original
+    // (at most half the quantisation step of its row, i.e. its row's largest weight / 131070).
+    inline float maxWeightError() const { return _maxErr;}
+
+private:
+    size_t _K;
+    std::vector<float> _scale;      // Quantisation step of each row
+    std::vector<uint16_t> _qwts;    // Quantised weights
+    std::vector<int> _base;         // Smallest neighbour index in each block (-1 if full width)...
+    std::vector<uint16_t> _deltas;  // ...and the offsets from it of the neighbours of its rows
+    std::vector<int> _wide;         // Full width indices of blocks spanning 2^16 or more vertices
+    std::vector<size_t> _start;     // Start of each block's rows in either _deltas or _wide
+    float _maxErr;
+};  // end class
+
+}   // end namespace
+
+#endif
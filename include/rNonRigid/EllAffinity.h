@@ -0,0 +1,74 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_ELL_AFFINITY_H
+#define RNONRIGID_ELL_AFFINITY_H
+
+/**
+ * Affinities from each of a set of query points to at most a fixed number (the width) of
+ * target points, stored as a pair of (query x width) matrices of target rows and affinity
+ * values (ELL format). The nearest neighbour searches give exactly this shape so rows are
+ * filled in place, in parallel, without the sorting needed to build a general sparse matrix.
+ * Unused entries at the end of a row have target row -1 and value zero.
+ */
+#include "Types.h"
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT EllAffinity
+{
+public:
+    EllAffinity() : _ncols(0) {}
+
+    // Takes the target rows and affinity values (same dimensions) for ncols target points.
+    EllAffinity( MatXi &&idxs, MatXf &&vals, size_t ncols);
+
+    // Number of query points, entries per query and target points.
+    inline size_t rows() const { return size_t(_idxs.rows());}
+    inline size_t width() const { return size_t(_idxs.cols());}
+    inline size_t cols() const { return _ncols;}
+    inline bool empty() const { return _idxs.size() == 0;}
+
+    // The target row and affinity of entry k of query row i (-1 and zero if unused).
+    inline int index( size_t i, size_t k) const { return _idxs(i,k);}
+    inline float value( size_t i, size_t k) const { return _vals(i,k);}
+
+    inline const MatXi& indices() const { return _idxs;}
+    inline const MatXf& values() const { return _vals;}
+
+    // Returns the sum of the affinities in each row.
+    VecXf rowSums() const;
+
+    // As above but setting the given vector (resized only if needed).
+    void rowSums( VecXf&) const;
+
+    // Swaps the target rows and affinity values out into the given matrices leaving this empty,
+    // e.g. so that their storage can be reused for the next set of affinities.
+    void release( MatXi &idxs, MatXf &vals);
+
+    // Returns as a rows() x cols() sparse matrix.
+    SparseMat toSparse() const;
+
+private:
+    MatXi _idxs;
+    MatXf _vals;
+    size_t _ncols;
+};  // end class
+
+}   // end namespace
+
+#endif
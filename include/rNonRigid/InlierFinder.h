@@ -28,10 +28,17 @@ public:
     InlierFinder( float kappa=4.0f, bool useOrientation=true, size_t numIterations=10);
 
     // Returns a vector giving the probability of each element in flt being an inlier
-    // given the updated feature correspondences (crs) and flags.
+    // given the updated feature correspondences (crs) and flags. Elements with zero
+    // flags (including those without any correspondence) have zero probability and
+    // don't contribute to the estimated spread of the inlier distances.
     VecXf operator()( const MatXf &flt,      // N rows X M columns
                       const MatXf &crs,      // N rows X M columns
                       const VecXf &flags) const; // N rows
+
+    // As above but setting the probabilities in probs with the squared distances between the
+    // features held in sqDists. Both vectors' storage is reused if they're already N long.
+    void operator()( const MatXf &flt, const MatXf &crs, const VecXf &flags,
+                     VecXf &probs, VecXf &sqDists) const;
 private:
     const float _kappa;
     const bool _useOrientation;
@@ -0,0 +1,54 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_K3_BRUTE_H
+#define RNONRIGID_K3_BRUTE_H
+
+/**
+ * Exhaustive nearest neighbour search. There is nothing to build so for small point sets
+ * this beats a tree on total cost. Batch queries are tiled so that a block of points is
+ * checked against a block of queries while both are in cache, with the distances to each
+ * point block calculated using vectorised (SSE/AVX) operations.
+ */
+#include "K3Index.h"
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT K3Brute : public K3Index
+{
+public:
+    explicit K3Brute( const MatX3fRef&);
+
+    // Returns a view of the copy of the points passed in to the constructor (or to the last call to refit).
+    MatX3fView data() const override { return viewOf( _data);}
+
+    // Just copies in the new positions (maxGrowth is ignored). Always returns true.
+    bool refit( const MatX3fRef&, float maxGrowth=1.5f) override;
+
+    using K3Index::findn;
+    size_t findn( const Vec3f&, size_t n, size_t *ridxs, float *sqdis, float maxSqDis=FLT_MAX) const override;
+
+    void findn( const MatX3fRef &Q, size_t n, MatXi &ridxs, MatXf &sqdis, size_t numThreads=1,
+                float maxSqDis=FLT_MAX) const override;
+
+private:
+    MatX3f _data;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,63 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_K3_GRID_H
+#define RNONRIGID_K3_GRID_H
+
+/**
+ * A uniform grid of cubic cells over points in 3 space. Construction is a single O(N)
+ * counting sort of the points into their cells and nearest neighbour queries expand
+ * outwards from the query's cell one ring of cells at a time until no closer points
+ * can exist. Best suited to point sets of fairly uniform density (e.g. surface scans)
+ * that are re-indexed often such as a deforming floating surface.
+ */
+#include "K3Index.h"
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT K3Grid : public K3Index
+{
+public:
+    // Create the grid over the rows of the given matrix. If cellSize is not positive, it is
+    // chosen so that the cells a surface passes through hold a few points each on average.
+    explicit K3Grid( const MatX3fRef&, float cellSize=0.0f);
+    ~K3Grid() override;
+
+    // Returns a view of the grid's copy of the points passed in to the constructor (or to the last call to refit).
+    MatX3fView data() const override;
+
+    // Returns the side length of the cells.
+    float cellSize() const;
+
+    // Grid construction is O(N) so refitting is the same as rebuilding (maxGrowth is ignored).
+    // The cell size is recalculated if it was chosen automatically. Always returns true.
+    bool refit( const MatX3fRef&, float maxGrowth=1.5f) override;
+
+    using K3Index::findn;
+    size_t findn( const Vec3f&, size_t n, size_t *ridxs, float *sqdis, float maxSqDis=FLT_MAX) const override;
+
+private:
+    class Impl;
+    Impl *_impl;
+
+    K3Grid( const K3Grid&) = delete;
+    K3Grid& operator=( const K3Grid&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
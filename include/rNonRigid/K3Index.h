@@ -0,0 +1,112 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_K3_INDEX_H
+#define RNONRIGID_K3_INDEX_H
+
+/**
+ * Interface for nearest neighbour search engines over points in 3 space. All engines
+ * return exactly the same neighbours (ties in distance being broken by point index)
+ * so they can be swapped freely according to which is fastest for the data.
+ */
+#include "Types.h"
+#include <cfloat>
+#include <memory>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT K3Index
+{
+public:
+    virtual ~K3Index() {}
+
+    // Returns a view of the points (one per row) the index was created (or last refit) with.
+    virtual MatX3fView data() const = 0;
+
+    // Returns the number of points in the set.
+    inline size_t numPoints() const { return (size_t)data().rows();}
+
+    // Update the index for new positions of the same points (rows of the given matrix must
+    // correspond to the rows of the original). Indices that can be refit in place do so until
+    // their query performance degrades by maxGrowth (see K3Tree) and otherwise rebuild.
+    // Returns true iff the index was fully rebuilt.
+    virtual bool refit( const MatX3fRef&, float maxGrowth=1.5f) = 0;
+
+    // Find the n points closest to the given feature. Arrays ridxs and sqdis must
+    // be arrays of length n. Returns actual number of points found which may be less than n.
+    // Only points within squared distance maxSqDis of the feature are returned.
+    virtual size_t findn( const Vec3f&, size_t n, size_t *ridxs, float *sqdis, float maxSqDis=FLT_MAX) const = 0;
+
+    // Find the n points closest to each row of Q (batch query). On return, row i of ridxs
+    // and sqdis gives the indices and squared distances of the points closest to Q.row(i)
+    // in ascending order of distance. The matrices are resized to Q.rows() x n only if not
+    // already that size. If fewer than n points are in the set, unused entries are set to
+    // -1 (index) and FLT_MAX (squared distance) as are entries for points further than maxSqDis
+    // from the query. Rows of Q are split over numThreads threads with results identical to the
+    // serial case.
+    virtual void findn( const MatX3fRef &Q, size_t n, MatXi &ridxs, MatXf &sqdis, size_t numThreads=1,
+                        float maxSqDis=FLT_MAX) const;
+
+    // Batch query warm started from a guess at the neighbours of each row of Q, e.g. those found
+    // for the same query in the previous iteration of a registration when points move only a
+    // little. Row i of seeds gives the indices of distinct points near Q.row(i) (negative entries
+    // are ignored). Where a row has at least n seeds, the search is limited to the sphere around
+    // the query that holds them so most of the index is pruned straight away. Other rows (and any
+    // rows beyond those of seeds) are searched as normal. Results are identical to the unseeded query.
+    // If ridxs is already Q.rows() x n, seeds may be ridxs itself since each row's seeds are read
+    // before the row is overwritten.
+    virtual void findn( const MatX3fRef &Q, size_t n, const MatXi &seeds,
+                        MatXi &ridxs, MatXf &sqdis, size_t numThreads=1, float maxSqDis=FLT_MAX) const;
+
+protected:
+    // Set row i of a batch query's results from the found points closest to Q.row(i).
+    static inline void setRow( size_t i, size_t n, size_t found, const size_t *nv, const float *sqd,
+                               MatXi &ridxs, MatXf &sqdis)
+    {
+        for ( size_t k = 0; k < found; ++k)
+        {
+            ridxs(i,k) = int(nv[k]);
+            sqdis(i,k) = sqd[k];
+        }   // end for
+        for ( size_t k = found; k < n; ++k)
+        {
+            ridxs(i,k) = -1;
+            sqdis(i,k) = FLT_MAX;
+        }   // end for
+    }   // end setRow
+};  // end class
+
+
+enum struct IndexType
+{
+    TREE,   // K3Tree
+    GRID,   // K3Grid
+    BRUTE,  // K3Brute
+    AUTO    // K3Brute for small point sets, otherwise K3Tree
+};  // end enum
+
+// Create a nearest neighbour index of the given type over the rows of the given matrix.
+// Indices that support it are built (and rebuilt on refit) using numThreads threads.
+rNonRigid_EXPORT std::shared_ptr<K3Index> createIndex( const MatX3f&, IndexType=IndexType::AUTO, size_t numThreads=1);
+
+// As above but a K3Tree is created over the viewed points without copying them so the viewed
+// storage must outlive the index (see K3Tree). Other types of index copy the points.
+rNonRigid_EXPORT std::shared_ptr<K3Index> createIndex( const MatX3fView&, IndexType=IndexType::AUTO, size_t numThreads=1);
+
+}   // end namespace
+
+#endif
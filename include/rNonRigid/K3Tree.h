@@ -18,51 +18,94 @@
 #ifndef RNONRIGID_K3_TREE_H
 #define RNONRIGID_K3_TREE_H
 
-#include "Types.h"
+/**
+ * A kd-tree over points in 3 space. Points are stored a second time in leaf order with the
+ * X, Y and Z coordinates of each leaf held in contiguous blocks so that a query is checked
+ * against all points of a leaf at once using vectorised distance calculations.
+ */
+#include "K3Index.h"
+#include "MappedFile.h"
+#include <iosfwd>
+#include <string>
 
 namespace rNonRigid {
 
-class rNonRigid_EXPORT K3Tree
+class rNonRigid_EXPORT K3Tree : public K3Index
 {
 public:
     // Create a K3-tree from the given matrix where the number of rows equate
     // to points and the columns are the coordinates of the vertices.
-    explicit K3Tree( const MatX3f&);
-    ~K3Tree();
+    // Parameters:
+    // leafSize:    Maximum number of points in a leaf (clamped to [1,64]). Larger leaves make
+    //              for shallower trees that are quicker to build and traverse at the cost
+    //              of checking more points per leaf.
+    // numThreads:  Number of threads to build the tree with (including on rebuilds from refit).
+    //              The largest nodes at the top are partitioned about their medians using
+    //              all the threads, the nodes of the next levels are partitioned concurrently,
+    //              and the subtrees beneath are then built in parallel. The tree produced is
+    //              the same for any number of threads.
+    explicit K3Tree( const MatX3f&, size_t leafSize=16, size_t numThreads=1);
 
-    // Returns the matrix passed in to the constructor.
-    const MatX3f& data() const;
+    // Create the tree over points held elsewhere without copying them (e.g. over the positions
+    // of a mesh using Mesh::positionsView). The viewed storage must outlive the tree and must
+    // not be resized. Its points may be changed in place but the tree must then be updated by
+    // passing the same storage to refit before it's next queried.
+    explicit K3Tree( const MatX3fView&, size_t leafSize=16, size_t numThreads=1);
+    ~K3Tree() override;
 
-    // Returns the number of points in the set.
-    inline size_t numPoints() const { return (size_t)data().rows();}
+    // Save the tree (its nodes and points) to a versioned binary file in native byte order.
+    // Returns true iff the file was written.
+    bool save( const std::string &fname) const;
 
-    // Find the n points closest to the given feature. Arrays ridxs and sqdis must
-    // be arrays of length n. Returns actual number of points found which may be less than n.
-    size_t findn( const Vec3f&, size_t n, size_t *ridxs, float *sqdis) const;
+    // Load a tree saved by save. The file is memory mapped and queried in place without any
+    // rebuild, with pages shared between all processes using the same file. Loading only reads
+    // the nodes and permutation to check they form a valid tree over the points (a single
+    // linear pass). The loaded tree may be queried concurrently by any number of threads.
+    // A refit first copies the tree into memory. Returns null if the file can't be read, wasn't
+    // saved by this version of the library (and platform), or is truncated or corrupt.
+    static std::shared_ptr<K3Tree> load( const std::string &fname, size_t numThreads=1);
+
+    // As above but saving the tree at the stream's current position (which should be a multiple
+    // of fileAlignment bytes into the file for the tree to be loadable in place) or loading the
+    // tree saved at the given offset into an already mapped file (e.g. as part of a larger file).
+    bool save( std::ostream&) const;
+    static std::shared_ptr<K3Tree> load( const std::shared_ptr<MappedFile>&, size_t offset, size_t numThreads=1);
+
+    // Returns the byte alignment of the sections of saved trees.
+    static size_t fileAlignment();
+
+    // Returns a view of the points passed in to the constructor (or to the last call to refit).
+    MatX3fView data() const override;
+
+    // Update the tree for new positions of the same points (the rows of the given matrix must
+    // correspond to the rows of the original). Rather than rebuilding, the existing split structure
+    // is kept and only the bounds of the nodes are recalculated in a single O(N) pass. This is ideal
+    // when points move only a little between calls. Moving points make node bounds grow and overlap
+    // which slows queries, so if the total leaf extent relative to the extent of the whole set grows
+    // by more than maxGrowth times since the last full build, the tree is rebuilt instead.
+    // If the tree references the caller's storage (see above) and the given points are that same
+    // storage, nothing is copied. Otherwise the points are copied and the tree keeps its own copy.
+    // Returns true iff the tree was rebuilt.
+    bool refit( const MatX3fRef&, float maxGrowth=1.5f) override;
+
+    using K3Index::findn;
+    size_t findn( const Vec3f&, size_t n, size_t *ridxs, float *sqdis, float maxSqDis=FLT_MAX) const override;
+
+    // Batch queries are answered fastest when Q is spatially coherent (consecutive rows close
+    // together) since each query starts by checking the leaf that the previous query's nearest
+    // point was found in.
+    void findn( const MatX3fRef &Q, size_t n, MatXi &ridxs, MatXf &sqdis, size_t numThreads=1,
+                float maxSqDis=FLT_MAX) const override;
 
 private:
     class Impl;
     Impl *_impl;
+    explicit K3Tree( Impl*);
 
     K3Tree( const K3Tree&) = delete;
     K3Tree& operator=( const K3Tree&) = delete;
 };  // end class
 
-
-template <typename T>
-class S3Points
-{
-public:
-    S3Points( const MatX3f& m) : _m(m) {}
-    inline size_t kdtree_get_point_count() const { return (size_t)_m.rows();}
-    inline T kdtree_get_pt( const size_t idx, int dim) const { return _m((int)idx, dim);}
-    template <class BBOX>
-    inline bool kdtree_get_bbox( BBOX&) const { return false;}
-    const MatX3f& model() const { return _m;}
-private:
-    const MatX3f _m;
-};  // end class
-
 }   // end namespace
 
 #endif
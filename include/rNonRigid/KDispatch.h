@@ -0,0 +1,84 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_K_DISPATCH_H
+#define RNONRIGID_K_DISPATCH_H
+
+/**
+ * Dispatch from a neighbour count known only at runtime to kernels specialised at compile time
+ * for the commonly used counts so that their loops over neighbours can be unrolled and their
+ * per-query buffers kept on the stack. The kernel is a callable taking a FixedK<K> where K is
+ * the count, or zero for other counts in which case the kernel uses the runtime count instead.
+ */
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace rNonRigid {
+
+template <size_t K>
+using FixedK = std::integral_constant<size_t, K>;
+
+// Returns the neighbour count for a kernel specialised for K (k if K is zero).
+template <size_t K>
+constexpr size_t numK( size_t k) { return K > 0 ? K : k;}
+
+// Call fn with FixedK<k> if k is one of the specialised counts (3, 4, 8, 16, 32, 64 or 80)
+// or with FixedK<0> otherwise. Specialise only small kernels since each count is compiled.
+template <class Fn>
+void dispatchK( size_t k, Fn &&fn)
+{
+    switch ( k)
+    {
+        case 3:  fn( FixedK<3>());  break;
+        case 4:  fn( FixedK<4>());  break;
+        case 8:  fn( FixedK<8>());  break;
+        case 16: fn( FixedK<16>()); break;
+        case 32: fn( FixedK<32>()); break;
+        case 64: fn( FixedK<64>()); break;
+        case 80: fn( FixedK<80>()); break;
+        default: fn( FixedK<0>());  break;
+    }   // end switch
+}   // end dispatchK
+
+
+// Buffer of K elements on the stack (or of a runtime count on the heap if K is zero).
+template <typename T, size_t K>
+class KBuffer
+{
+public:
+    explicit KBuffer( size_t) {}
+    inline T* data() { return _a;}
+    inline T& operator[]( size_t i) { return _a[i];}
+private:
+    T _a[K];
+};  // end class
+
+template <typename T>
+class KBuffer<T,0>
+{
+public:
+    explicit KBuffer( size_t k) : _v(k) {}
+    inline T* data() { return _v.data();}
+    inline T& operator[]( size_t i) { return _v[i];}
+private:
+    std::vector<T> _v;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -23,29 +23,47 @@
  * corresponding to a given query mesh. Returns an affinity matrix of correspondences
  * with values in proportion to the inverse of the squared distances between the points.
  */
-#include "K3Tree.h"
+#include "EllAffinity.h"
+#include "K3Index.h"
 
 namespace rNonRigid {
 
 class rNonRigid_EXPORT KNNCorresponder
 {
 public:
-    // Query points (Q) are the rows of the given matrix with columns as X,Y,Z.
+    // Query points (Q) are the rows of the given matrix with columns as X,Y,Z. The points
+    // are not copied so must outlive this object.
     // Set k as the number of nearest neighbours on the target to search for.
-    KNNCorresponder( const MatX3f& Q, size_t k=3);
+    // Queries are split over numThreads threads with results identical to the serial case.
+    // If maxDist is positive, only target points within this distance of a query are
+    // searched for so queries far from the target have fewer than k (or no) correspondences.
+    KNNCorresponder( const MatX3fView& Q, size_t k=3, size_t numThreads=1, float maxDist=0.0f);
 
     // Return the Q x T affinity matrix where Q is the number of points in the query set
     // and T the number of points in the target set. Each entry is the inverse of the squared
     // distance between the query and the target points. Only vertices from the target set
-    // found within K nearest neighbours of the query points have non-zero entries.
+    // found within K nearest neighbours of the query points (and within maxDist if set)
+    // have non-zero entries so rows for queries without correspondences are empty.
     // Correspondence points C can be calculated from provided target points T and the
     // returned matrix A as C = AT. That is, each point coregistered to the query set
     // is the weighted sum of points in the target set.
-    SparseMat find( const K3Tree& target) const;
+    SparseMat find( const K3Index& target) const;
+
+    // As find but setting A to the same affinities in fixed width form with the k neighbours
+    // of each query in order of increasing distance (missing neighbours at the end). The storage
+    // of A is reused if it has the right dimensions. If warm is set, the search is warm started
+    // from the neighbours in A (e.g. found in the last iteration of a registration) so that fewer
+    // points are visited when the query and target points have moved only a little, with the
+    // same result as the cold search.
+    void affinities( const K3Index& target, EllAffinity &A, bool warm) const;
 
 private:
-    const MatX3f& _qry;
+    const MatX3fView _qry;
     const size_t _k;
+    const size_t _nthreads;
+    const float _maxSqDis;
+
+    EllAffinity _affinities( const K3Index&, MatXi&, MatXf&) const;
 };  // end class
 
 // Normalise the rows of the given sparse matrix.
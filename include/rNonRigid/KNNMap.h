@@ -26,14 +26,15 @@
  * Find the nearest k points (rows) on the target matrix for every point (row)
  * in the query matrix. The target and query matrices can be the same.
  */
-#include "K3Tree.h"
+#include "K3Index.h"
 
 namespace rNonRigid {
 
 class rNonRigid_EXPORT KNNMap
 {
 public:
-    KNNMap( const MatX3f &query, const K3Tree &target, size_t k);
+    // Query rows are split over numThreads threads with results identical to the serial case.
+    KNNMap( const MatX3fRef &query, const K3Index &target, size_t k, size_t numThreads=1);
 
     const MatXi& indices() const { return _idxs;}
     const MatXf& sqDiffs() const { return _sqds;}
@@ -0,0 +1,71 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_KNN_RESULT_SET_H
+#define RNONRIGID_KNN_RESULT_SET_H
+
+/**
+ * The n closest points found so far by a nearest neighbour search, kept in ascending
+ * order of squared distance in caller provided arrays. Ties in distance are ordered by
+ * point index so the result doesn't depend on the order in which points are visited
+ * (different index types and thread counts give identical results). The search may be
+ * limited to points within a given squared distance.
+ */
+#include <cfloat>
+#include <cstddef>
+
+namespace rNonRigid {
+
+class KNNResultSet
+{
+public:
+    KNNResultSet( size_t n, size_t *idxs, float *sqdis, float maxSqDis=FLT_MAX)
+        : _n(n), _cnt(0), _idxs(idxs), _sqdis(sqdis), _maxSqDis(maxSqDis) {}
+
+    // Number of points found so far.
+    inline size_t size() const { return _cnt;}
+
+    // Points further than this can't be added.
+    inline float worst() const { return _cnt < _n ? _maxSqDis : _sqdis[_n-1];}
+
+    // Add the point if it's closer than the current worst and return true iff it's now the closest.
+    inline bool add( size_t idx, float d)
+    {
+        if ( d > _maxSqDis || (_cnt == _n && (d > _sqdis[_n-1] || (d == _sqdis[_n-1] && idx > _idxs[_n-1]))))
+            return false;
+        size_t i = _cnt < _n ? _cnt++ : _n-1;
+        for ( ; i > 0 && (_sqdis[i-1] > d || (_sqdis[i-1] == d && _idxs[i-1] > idx)); --i)
+        {
+            _sqdis[i] = _sqdis[i-1];
+            _idxs[i] = _idxs[i-1];
+        }   // end for
+        _sqdis[i] = d;
+        _idxs[i] = idx;
+        return i == 0;
+    }   // end add
+
+private:
+    const size_t _n;
+    size_t _cnt;
+    size_t *_idxs;
+    float *_sqdis;
+    const float _maxSqDis;
+};  // end class
+
+}   // end namespace
+
+#endif
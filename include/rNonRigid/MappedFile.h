@@ -0,0 +1,56 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_MAPPED_FILE_H
+#define RNONRIGID_MAPPED_FILE_H
+
+/**
+ * A whole file mapped read only into memory. Pages are loaded on first access and shared
+ * by all processes mapping the same file. Where memory mapping isn't available (Windows)
+ * the file is read into memory instead.
+ */
+#include "rNonRigid_Export.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT MappedFile
+{
+public:
+    // Returns null if the file can't be opened or mapped.
+    static std::shared_ptr<MappedFile> open( const std::string &fname);
+
+    ~MappedFile();
+
+    inline const char* data() const { return _data;}
+    inline size_t size() const { return _size;}
+
+private:
+    const char *_data;
+    size_t _size;
+    std::vector<char> _buf;  // Holds the file if it can't be mapped
+
+    MappedFile() : _data(nullptr), _size(0) {}
+    MappedFile( const MappedFile&) = delete;
+    MappedFile& operator=( const MappedFile&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
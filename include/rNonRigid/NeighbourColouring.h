@@ -0,0 +1,72 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_NEIGHBOUR_COLOURING_H
+#define RNONRIGID_NEIGHBOUR_COLOURING_H
+
+/**
+ * A colouring of the neighbour graph of a template's smoothing weights such that no vertex has
+ * the same colour as any of its neighbours or any vertex having it as a neighbour. Vertices of
+ * the same colour can then be updated in place from their neighbours concurrently since none
+ * reads what another writes. Updating the colours in turn is a Gauss-Seidel pass over the
+ * vertices in colour order. This isn't equivalent to a pass in index order (a vertex reads
+ * the updated values of the neighbours in earlier colours rather than of those with lower
+ * indices) so results differ slightly from those of a serial pass in index order, though they
+ * are the same for any number of threads. The colouring depends only on the template's
+ * neighbours so is built once per template alongside its smoothing weights.
+ */
+#include "CompactWeights.h"
+#include "StreamedWeights.h"
+#include <functional>
+#include <vector>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT NeighbourColouring
+{
+public:
+    // Greedily colours the vertices in index order with the lowest colour not already
+    // taken by a neighbour in either direction.
+    explicit NeighbourColouring( const SmoothingWeights&);
+    explicit NeighbourColouring( const StreamedWeights&);
+    explicit NeighbourColouring( const CompactWeights&);
+
+    // Restore a colouring from the colours() of one made previously (e.g. by TemplatePackage).
+    explicit NeighbourColouring( const std::vector<int> &colours);
+
+    inline size_t numColours() const { return _colourStart.size() - 1;}
+
+    // Returns the colour of each vertex.
+    inline const std::vector<int>& colours() const { return _colour;}
+
+    // The vertices ordered by colour (and by index within a colour) with the vertices of colour c
+    // in order()[colourStarts()[c]] to order()[colourStarts()[c+1]-1].
+    inline const std::vector<int>& order() const { return _order;}
+    inline const std::vector<int>& colourStarts() const { return _colourStart;}
+
+private:
+    std::vector<int> _colour;
+    std::vector<int> _order;
+    std::vector<int> _colourStart;
+
+    void _colourRows( size_t N, size_t K, const std::function<const int*(size_t)> &row);
+    void _orderColours( int numColours);
+};  // end class
+
+}   // end namespace
+
+#endif
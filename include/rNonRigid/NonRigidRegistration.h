@@ -18,14 +18,74 @@
 #ifndef RNONRIGID_NON_RIGID_REGISTRATION_H
 #define RNONRIGID_NON_RIGID_REGISTRATION_H
 
-#include "SymmetricCorresponder.h"
+#include "RegistrationWorkspace.h"
 #include "InlierFinder.h"
+#include "TemplatePackage.h"
 
 namespace rNonRigid {
 
 class rNonRigid_EXPORT NonRigidRegistration
 {
 public:
+    // Settings beyond those of the original algorithm, each defaulting to its original behaviour.
+    struct Options
+    {
+        Options() : numThreads(1), floatingIndex(IndexType::AUTO), maxCorrDist(0.0f), cropPadding(0.0f),
+                    smoothTol(0.0f), smoothLevels(1), compactWeights(false), smoothBudget(0),
+                    reorderVertices(false) {}
+
+        // Number of threads to build indices, split nearest neighbour searches and relax the
+        // displacement fields over. Results are the same for any number of threads above one
+        // but differ slightly from those of one thread which diffuses the outliers in index
+        // order rather than a colour at a time (see ViscoElasticTransformer).
+        size_t numThreads;
+
+        // Type of index used for nearest neighbour searches on the floating surface.
+        IndexType floatingIndex;
+
+        // If positive, the maximum distance between corresponding points. Floating points further
+        // than this from the target (e.g. where a scan is partial) are treated as outliers without
+        // a correspondence and are moved only by their neighbours.
+        float maxCorrDist;
+
+        // If positive, the target is cropped to the bounding box of the floating surface padded by
+        // this proportion of its diagonal (see RegionOfInterest) so that only the overlapping part
+        // of a large target is searched. The crop is updated as the floating surface deforms.
+        float cropPadding;
+
+        // If positive, the viscous and elastic sweeps are approximated by fewer applications of
+        // a symmetrised smoothing operator to within this tolerance of as many applications of it
+        // as sweeps. It smooths less than the sweeps so results differ from theirs by more than
+        // this (see ViscoElasticTransformer).
+        float smoothTol;
+
+        // If more than one, the viscous and elastic sweeps are approximated by multigrid V-cycles
+        // over a hierarchy of up to this many levels (see SmoothingHierarchy).
+        size_t smoothLevels;
+
+        // Whether the smoothing weights are replaced by a compact copy with 16 bit weights and
+        // neighbour offsets (see CompactWeights) for the regularisation. The weights are freed
+        // once copied (unless from a template package), which roughly halves the memory they take.
+        bool compactWeights;
+
+        // If positive, the smoothing weights aren't all held in memory but computed a block of
+        // vertices at a time as needed with at most this many bytes of blocks kept for reuse (see
+        // StreamedWeights). Other blocks are paged to a temporary file. Results are unchanged.
+        // smoothTol, smoothLevels and compactWeights are ignored. The blocks are found using a
+        // second index over a copy of the floating positions. With more than one thread, making
+        // the colouring for the outlier diffusion (see NeighbourColouring) holds the colours of
+        // vertices passed on to their neighbours not yet coloured outside the budget: up to one
+        // int per neighbour of every vertex, but far fewer if the neighbours of each vertex are
+        // near it in the order (see reorderVertices).
+        size_t smoothBudget;
+
+        // Whether the rows of the floating surface are put in Morton order for the registration
+        // (see VertexOrder) so that the neighbours of each vertex are mostly in nearby rows. The
+        // caller's order is restored on return. Results differ slightly from those in the
+        // caller's order since the outliers are diffused in vertex order.
+        bool reorderVertices;
+    };  // end struct
+
     // Parameters:
     // numUpdateIts     : number of iterations required.
     // k                : KNN when looking for closest points on the opposite surface.
@@ -40,19 +100,39 @@ public:
     // numViscousEnd    : final number of viscous steps when finishing transform.
     // numElasticStart  : starting number of elastic steps when beginning transform.
     // numElasticEnd    : final number of elastic steps when finishing transform.
+    // options          : further settings (see Options).
     NonRigidRegistration( size_t numUpdateIts=200,
                           size_t k=3, float flagThresh=0.9f, bool eqPushPull=true,
                           float kappa=4.0f, bool useOrient=true, size_t numInlierIts=10,
                           size_t smoothK=80, float smoothS=3.0f,
                           size_t numViscousStart=100, size_t numViscousEnd=1,
-                          size_t numElasticStart=100, size_t numElasticEnd=1);
+                          size_t numElasticStart=100, size_t numElasticEnd=1,
+                          const Options &options=Options());
 
     // Find the non-rigid registration between F and T where points are stored row
     // wise with each row having 6 elements as X,Y,Z position and X,Y,Z normal.
     // On return, F has its features registered to surface T.
-    // F : the floating template to map to the target.
-    // T : the target to which the floating template is mapped.
-    void operator()( Mesh &F, const Mesh &T) const;
+    // F         : the floating template to map to the target.
+    // T         : the target to which the floating template is mapped.
+    // workspace : if given, the scratch buffers of the iterations are held in it rather than
+    //             allocated afresh, leaving them sized for the next registration to use it
+    //             (see RegistrationWorkspace).
+    // pkg       : if given, the smoothing weights, outlier colouring and initial floating index
+    //             are taken from this package saved for F (see TemplatePackage) instead of being
+    //             computed, as is the smoothing hierarchy if the package was loaded with the same
+    //             smoothLevels. It may be shared with other registrations running concurrently.
+    //             With a package, floatingIndex and smoothBudget are ignored and F is reordered
+    //             iff the package has a vertex order. If the package wasn't made for F's positions
+    //             (up to a rotation and translation, see TemplatePackage::matches) with smoothK
+    //             and smoothS, it isn't used and everything is computed as usual.
+    // tindex    : if given, this index over the positions of T is used instead of building one,
+    //             e.g. a K3Tree saved for a fixed target and loaded with K3Tree::load so that
+    //             registering many floating surfaces to the same target doesn't rebuild its index
+    //             every time. It's only queried so may be shared with other registrations running
+    //             concurrently. It isn't used while the target is cropped (see cropPadding).
+    // Returns true iff a package was given and used.
+    bool operator()( Mesh &F, const Mesh &T, RegistrationWorkspace *workspace=nullptr,
+                     const TemplatePackage *pkg=nullptr, const std::shared_ptr<K3Index> &tindex=nullptr) const;
 
 private:
     const size_t _numUpdateIts;
@@ -62,6 +142,17 @@ private:
     const InlierFinder _inlierFinder;
     const size_t _nvStart, _nvEnd;
     const size_t _neStart, _neEnd;
+    const size_t _nthreads;
+    const IndexType _fltIndex;
+    const float _cropPad;
+    const float _smoothTol;
+    const size_t _smoothLevels;
+    const bool _compactWeights;
+    const size_t _smoothBudget;
+    const bool _reorder;
+
+    void _register( Mesh&, const Mesh&, const std::shared_ptr<K3Index>&, const TemplatePackage*,
+                    RegistrationWorkspace&) const;
 };  // end class
 
 }   // end namespace
@@ -25,17 +25,19 @@ namespace rNonRigid {
 class rNonRigid_EXPORT NonSymmetricCorresponder
 {
 public:
-    // k : each point in F looks for k nearest neighbours on T
-    explicit NonSymmetricCorresponder( size_t k=3);
+    // k          : each point in F looks for k nearest neighbours on T
+    // numThreads : number of threads to split the nearest neighbour search over.
+    explicit NonSymmetricCorresponder( size_t k=3, size_t numThreads=1);
 
     // Find and return affinity matrix A between F and T. Used to calculate a set
     // of features as A * T.data() corresponding to the entries of F.
     // F      : F rows by 3 columns query points (floating mask)
-    // T      : kd-tree for the target points (has T points)
-    SparseMat operator()( const MatX3f& F, const K3Tree& T) const;
+    // T      : index (e.g. kd-tree or grid) for the target points (has T points)
+    SparseMat operator()( const MatX3f& F, const K3Index& T) const;
 
 private:
     size_t _k;
+    size_t _nthreads;
 };  // end class
 
 }   // end namespace
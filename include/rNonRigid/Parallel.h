@@ -0,0 +1,49 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_PARALLEL_H
+#define RNONRIGID_PARALLEL_H
+
+/**
+ * Chunked parallel loops over a process wide pool of worker threads. The pool grows to the
+ * largest thread count requested and its threads persist between calls so that tight loops
+ * (e.g. once per registration iteration) don't pay for thread creation every time.
+ */
+#include "rNonRigid_Export.h"
+#include <functional>
+#include <cstddef>
+
+namespace rNonRigid {
+
+// Split the range [0,n) into contiguous chunks of at least minChunk elements and call
+// fn(begin, end) once for each chunk using up to nthreads threads (the calling thread
+// being one of them). Chunks are processed in no particular order so fn must only write
+// to state that is disjoint between chunks. Returns after every chunk has been processed.
+// If nthreads <= 1 (or n is too small to split) fn(0,n) is simply called on this thread.
+rNonRigid_EXPORT void parallelFor( size_t n, size_t nthreads,
+                                   const std::function<void(size_t, size_t)> &fn,
+                                   size_t minChunk=256);
+
+// Call a and b concurrently on up to two threads (the calling thread being one of them) if
+// nthreads > 1, or one after the other otherwise. Both may themselves call parallelFor with
+// their chunks shared over the same pool. Returns after both have returned.
+rNonRigid_EXPORT void parallelInvoke( const std::function<void()> &a, const std::function<void()> &b,
+                                      size_t nthreads);
+
+}   // end namespace
+
+#endif
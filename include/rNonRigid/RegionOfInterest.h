@@ -0,0 +1,79 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_REGION_OF_INTEREST_H
+#define RNONRIGID_REGION_OF_INTEREST_H
+
+/**
+ * Crops a target to the region around a floating surface so that correspondence searches
+ * from the target (and the index over it) scale with the overlap between the surfaces rather
+ * than with the whole target (e.g. a scan that includes shoulders, hair and background).
+ * The crop box is the bounding box of the floating points padded on every side. It is kept
+ * while the floating points stay well inside it and recalculated when they approach its sides
+ * or when the floating surface shrinks well inside it as a registration converges.
+ */
+#include "Types.h"
+#include <vector>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT RegionOfInterest
+{
+public:
+    // Parameters:
+    // target   : target features (positions in the first three columns). Must outlive this object.
+    // padding  : padding on each side of the floating bounding box as a proportion of the length
+    //            of its diagonal. If not positive, the target is never cropped.
+    // minRows  : the full target is used if the crop would have fewer rows than this.
+    RegionOfInterest( const MatXf &target, float padding=0.1f, size_t minRows=1);
+
+    // Update the crop for the given floating positions.
+    // Returns true iff the cropped target changed.
+    bool update( const MatX3fRef &flt);
+
+    // Returns true iff the target is currently cropped.
+    inline bool isCropped() const { return _cropped;}
+
+    // Returns the rows of the target inside the crop box (all rows if not cropped).
+    // The features and the view of their positions are valid until the next update.
+    inline const MatXf& features() const { return _cropped ? _crop : _full;}
+    inline MatX3fView positions() const
+    {
+        const MatXf &f = features();
+        return MatX3fView( f.data(), f.rows(), 3, Eigen::OuterStride<>( f.outerStride()));
+    }   // end positions
+
+    // Returns the row of the full target for each row of the cropped target (empty if not cropped).
+    inline const std::vector<int>& indices() const { return _idxs;}
+
+    // Returns the row of the full target for the given row of the cropped target.
+    inline int fullIndex( int i) const { return _cropped ? _idxs[i] : i;}
+
+private:
+    const MatXf &_full;
+    const float _padding;
+    const size_t _minRows;
+    bool _cropped;
+    bool _hasBox;
+    Vec3f _lo, _hi;         // The current crop box (the full target is used if it holds too few points)
+    MatXf _crop;
+    std::vector<int> _idxs;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,46 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_REGISTRATION_WORKSPACE_H
+#define RNONRIGID_REGISTRATION_WORKSPACE_H
+
+/**
+ * The scratch buffers of NonRigidRegistration's iterations, sized on first use. A workspace
+ * passed to successive registrations is reused by every iteration of each and, where the
+ * floating and target surfaces have the same sizes as last time, by every registration after
+ * the first, so that once sized the iterations allocate nothing large. A workspace may only be
+ * used by one registration at a time so registrations running concurrently need one each.
+ */
+#include "SymmetricCorresponder.h"
+#include "ViscoElasticTransformer.h"
+
+namespace rNonRigid {
+
+struct RegistrationWorkspace
+{
+    SymmetricCorresponder::WarmStart nbrs;  // Neighbours found by the correspondence searches
+    ViscoElasticTransformer::Workspace vet; // Regularisation of the displacement fields
+    MatXf crs;      // Correspondence features
+    VecXf flags;    // Correspondence flags
+    VecXf wts;      // Inlier weights
+    VecXf sqDists;  // Squared distances between the floating points and their correspondences
+    MatX3f df;      // Displacement field
+};  // end struct
+
+}   // end namespace
+
+#endif
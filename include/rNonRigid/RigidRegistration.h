@@ -35,21 +35,37 @@ public:
     // useOrient    : whether or not to use vertex normals when evaluating inlier correspondences.
     // numInlierIts : number of iterations over which inlier probabilities are re-calculated.
     // useScaling   : transform matrix generated per aligning iteration includes scaling.
+    // numThreads   : number of threads to build indices and split nearest neighbour searches over.
+    // fltIndex     : type of index used for nearest neighbour searches on the floating surface.
+    // maxCorrDist  : if positive, the maximum distance between corresponding points (points
+    //                further than this from the other surface don't contribute to the transform).
+    // cropPadding  : if positive, the target is cropped around the floating surface as it moves
+    //                with this padding as a proportion of its diagonal (see RegionOfInterest).
     RigidRegistration( size_t maxUpdateIts=200,
                        size_t k=3, float flagThresh=0.9f, bool eqPushPull=true,
                        float kappa=4.0f, bool useOrient=true, size_t numInlierIts=10, 
-                       bool useScaling=true);
+                       bool useScaling=true, size_t numThreads=1,
+                       IndexType fltIndex=IndexType::AUTO, float maxCorrDist=0.0f,
+                       float cropPadding=0.0f);
 
     // Apply the rigid registration to map mask to target.
     // Optionally provide an initial mask transform.
     // Returns the transform that was applied to mask.
     Mat4f operator()( Mesh &mask, const Mesh &target, Mat4f T=Mat4f::Identity()) const;
 
+    // As above but using the given (read only) index over the positions of target instead of
+    // building one (see NonRigidRegistration). It isn't used while the target is cropped.
+    Mat4f operator()( Mesh &mask, const Mesh &target, const std::shared_ptr<K3Index> &tindex,
+                      Mat4f T=Mat4f::Identity()) const;
+
 private:
     const size_t _maxUpdateIts;
     const SymmetricCorresponder _corresponder;
     const InlierFinder _inlierFinder;
     const bool _useScaling;
+    const size_t _nthreads;
+    const IndexType _fltIndex;
+    const float _cropPad;
 };  // end class
 
 }   // end namespace
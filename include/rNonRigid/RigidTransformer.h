@@ -32,8 +32,9 @@ public:
     // F  : N rows with vertex X,Y,Z positions in the columns.
     // C  : N rows with vertex X,Y,Z positions in the columns.
     // w  : N floats in [0,1] denoting how much each position contributes to the transform.
-    // Returns transform matrix M to get to C from F.
-    Mat4f operator()( const MatX3f &F, const MatX3f &C, const VecXf &w) const;
+    // Returns transform matrix M to get to C from F. The positions are read in place so may
+    // be views of the leading columns of larger matrices (e.g. Mesh::positionsView).
+    Mat4f operator()( const MatX3fRef &F, const MatX3fRef &C, const VecXf &w) const;
 
 private:
     const bool _useScaling;
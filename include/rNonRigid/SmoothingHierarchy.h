@@ -0,0 +1,91 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_SMOOTHING_HIERARCHY_H
+#define RNONRIGID_SMOOTHING_HIERARCHY_H
+
+/**
+ * A hierarchy of ever coarser clusterings of the vertices of a template for multigrid relaxation
+ * of displacement fields (see ViscoElasticTransformer). Level 0 is the template's vertices and
+ * each vertex of a coarser level is a cluster of neighbouring vertices of the level below found
+ * by greedy aggregation over the neighbour graph of the smoothing weights. Restriction averages
+ * the vectors of a cluster's members and prolongation copies a cluster's vector to its members.
+ * The hierarchy depends only on the template's smoothing neighbours so is built once and can be
+ * shared (read only) by any number of registrations of the same template.
+ */
+#include "SmoothingWeights.h"
+#include <vector>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT SmoothingHierarchy
+{
+public:
+    // swts       : the smoothing weights of the template's vertices.
+    // positions  : the template's vertex positions (as used to calculate swts).
+    // maxLevels  : maximum number of levels (including the template's). Coarsening also stops
+    //              when it no longer reduces the number of vertices much.
+    // aggregateK : number of a vertex's closest neighbours aggregated with it into a cluster.
+    SmoothingHierarchy( const SmoothingWeights &swts, const MatX3fRef &positions,
+                        size_t maxLevels=5, size_t aggregateK=8);
+
+    inline size_t numLevels() const { return _levels.size() + 1;}
+
+    // Returns the number of vertices on the given level.
+    inline size_t size( size_t level) const { return level == 0 ? _n0 : _levels[level-1].invSize.size();}
+
+    // Returns the positions of the vertices on the given level (the centroids of clusters).
+    inline const MatX3f& positions( size_t level) const { return level == 0 ? _pos0 : _levels[level-1].centroid;}
+
+    // For levels > 0, the cluster on the level of each vertex on the level below.
+    inline const std::vector<int>& clusters( size_t level) const { return _levels[level-1].cluster;}
+
+    // For levels > 0, the reciprocal of the number of members of each cluster.
+    inline const std::vector<float>& invSizes( size_t level) const { return _levels[level-1].invSize;}
+
+    // For levels > 0, the sparsity pattern (compressed rows) of the level's smoothing operator.
+    inline const std::vector<int>& rowStarts( size_t level) const { return _levels[level-1].rowStart;}
+    inline const std::vector<int>& columns( size_t level) const { return _levels[level-1].cols;}
+
+    // Given the weights of the template's smoothing operator W with A(i,k) the weight of the k-th
+    // neighbour of vertex i (for the first A.cols() neighbours), returns the values of the Galerkin
+    // operators R W P on each coarser level in the order of the level's columns (element l-1
+    // for level l). The operators only need recalculating when the template weights change.
+    std::vector<std::vector<float> > coarseOperators( const RowMatXf &A) const;
+
+private:
+    struct Level
+    {
+        std::vector<int> cluster;   // Cluster of each vertex on the level below
+        std::vector<float> invSize; // Reciprocal of each cluster's size
+        std::vector<int> rowStart;  // Operator rows (with end sentinel)...
+        std::vector<int> cols;      // ...and their columns
+        std::vector<int> slot;      // Position in cols of each entry of the operator on the level below
+        MatX3f centroid;            // Cluster centroids
+    };  // end struct
+
+    size_t _n0;                     // Number of template vertices
+    size_t _width;                  // Number of neighbours in the template's operator rows
+    MatX3f _pos0;                   // Template vertex positions
+    std::vector<Level> _levels;
+
+    void _scatter( size_t level, const float *fine, std::vector<float> &coarse) const;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -18,21 +18,38 @@
 #ifndef RNONRIGID_SMOOTHING_WEIGHTS_H
 #define RNONRIGID_SMOOTHING_WEIGHTS_H
 
-#include "K3Tree.h"
+#include "K3Index.h"
+#include <memory>
 
 namespace rNonRigid {
 
 class rNonRigid_EXPORT SmoothingWeights
 {
 public:
-    SmoothingWeights( const K3Tree&, size_t K, float sigma);
+    SmoothingWeights( const K3Index&, size_t K, float sigma, size_t numThreads=1);
 
-    const MatXi& indices() const { return _indices;}
-    const MatXf& weights() const { return _smw;}
+    // Use neighbours and weights held elsewhere (e.g. in a file mapped by TemplatePackage)
+    // without copying them. The viewed storage must remain valid while owner is held.
+    SmoothingWeights( const RowMatXiView &indices, const RowMatXfView &weights,
+                      const std::shared_ptr<const void> &owner);
+
+    SmoothingWeights( const SmoothingWeights&) = delete;
+    SmoothingWeights& operator=( const SmoothingWeights&) = delete;
+
+    // The K neighbours of each point and their normalised weights. Each row is contiguous.
+    const RowMatXiView& indices() const { return _iview;}
+    const RowMatXfView& weights() const { return _wview;}
+
+    // Set the K normalised weights of a point with the given squared distances to its neighbours
+    // (element k at sqdis[k*stride]) for a Gaussian of width sigma.
+    static void calcWeights( const float *sqdis, size_t stride, size_t K, float sigma, float *wts);
 
 private:
-    MatXi _indices;
-    MatXf _smw;
+    RowMatXi _indices;  // Held here unless viewed elsewhere
+    RowMatXf _smw;
+    RowMatXiView _iview;
+    RowMatXfView _wview;
+    std::shared_ptr<const void> _owner;
 };  // end class
 
 }   // end namespace
@@ -0,0 +1,96 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_STREAMED_WEIGHTS_H
+#define RNONRIGID_STREAMED_WEIGHTS_H
+
+/**
+ * The smoothing weights of a template (see SmoothingWeights) computed a block of BLOCK_ROWS
+ * vertices at a time on demand instead of all being held in memory. Blocks are found from an
+ * index over a copy of the template's positions in their initial state and are kept for reuse
+ * while the bytes of the kept blocks remain within a budget. Blocks beyond the budget are
+ * recomputed every time they're needed or, if paging, written to a temporary file when first
+ * computed and read back from it (much faster than finding the neighbours again). Blocks are
+ * read and written at their offsets in the file outside the lock so threads sweeping different
+ * blocks page concurrently. Sweeps over the vertices visit the blocks in order so keeping the
+ * first blocks to fit (rather than the least recently used, which a cyclic scan always evicts
+ * just before they're needed again) reuses as many blocks as the budget allows. The neighbours
+ * and weights are the same as those of SmoothingWeights given an index of the same type over
+ * the same positions.
+ */
+#include "SmoothingWeights.h"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT StreamedWeights
+{
+public:
+    static const size_t BLOCK_ROWS = 1024;
+
+    // The neighbours and weights of a block of rows (row r of block b is vertex b*BLOCK_ROWS+r).
+    struct Block
+    {
+        RowMatXi indices;
+        RowMatXf weights;
+    };  // end struct
+
+    // positions  : the template's vertex positions (copied).
+    // K, sigma   : the number of neighbours and width of the Gaussian weighting them.
+    // budget     : maximum number of bytes of blocks kept for reuse.
+    // indexType  : type of index over the positions used to find the neighbours.
+    // numThreads : number of threads to build the index over.
+    // page       : whether to page blocks beyond the budget to a temporary file. Blocks are
+    //              recomputed instead if the file can't be created or written.
+    StreamedWeights( const MatX3fRef &positions, size_t K, float sigma, size_t budget,
+                     IndexType indexType=IndexType::AUTO, size_t numThreads=1, bool page=false);
+
+    inline size_t rows() const { return size_t(_pos.rows());}
+    inline size_t cols() const { return _K;}
+    inline size_t numBlocks() const { return _blocks.size();}
+
+    // Returns block b, computing it if it isn't kept. Safe to call concurrently.
+    std::shared_ptr<const Block> block( size_t b) const;
+
+    // Returns the number of bytes in the blocks kept.
+    size_t keptBytes() const;
+
+    // Returns the number of times a block has been computed.
+    inline size_t numComputed() const { return _numComputed;}
+
+    StreamedWeights( const StreamedWeights&) = delete;
+    StreamedWeights& operator=( const StreamedWeights&) = delete;
+
+private:
+    const MatX3f _pos;
+    const size_t _K;
+    const float _sigma;
+    const size_t _budget;
+    std::shared_ptr<K3Index> _kdt;
+    mutable std::mutex _mtx;
+    mutable std::vector<std::shared_ptr<const Block> > _blocks;
+    mutable std::vector<char> _paged;   // State of each block in the file
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> _file;
+    mutable size_t _kept;
+    mutable std::atomic<size_t> _numComputed;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -19,6 +19,7 @@
 #define RNONRIGID_SYMMETRIC_CORRESPONDER_H
 
 #include "KNNCorresponder.h"
+#include <vector>
 
 namespace rNonRigid {
 
@@ -29,20 +30,73 @@ public:
     // flagThresh : affinity values higher than this cause flag values to be 1 (all others 0).
     // eqPushPull : push and pull affinity matrices are first independently row normalised before merging
     //              so that calculated features and flags do not bias either the query or target points.
-    SymmetricCorresponder( size_t k=3, float flagThresh=0.9f, bool eqPushPull=false);
+    // numThreads : number of threads to split the nearest neighbour searches over. If more than
+    //              one, the searches in each direction also run concurrently.
+    // maxDist    : if positive, points only correspond to points on the other surface within this
+    //              distance. Points on Q with no correspondences in either direction have empty
+    //              rows in the returned matrix and zero flags.
+    SymmetricCorresponder( size_t k=3, float flagThresh=0.9f, bool eqPushPull=false, size_t numThreads=1,
+                           float maxDist=0.0f);
+
+    // Returns the number of nearest neighbours searched for in each direction.
+    inline size_t k() const { return _k;}
 
     // Find and return affinity matrix A between Q and T. Should be used to calculate a set
     // of features as A * T.data() corresponding to the entries of Q. Also sets flags for
     // the correspondence features as out parameter flags.
-    // Q          : kd-tree for the query points.
-    // T          : kd-tree for the target points (has T points)
+    // Q          : index (e.g. kd-tree or grid) for the query points.
+    // T          : index for the target points (has T points)
     // flags      : Set as vector of {0,1} with entries corresponding to rows of returned matrix.
-    SparseMat operator()( const K3Tree& Q, const K3Tree& T, VecXf &flags) const;
+    SparseMat operator()( const K3Index& Q, const K3Index& T, VecXf &flags) const;
+
+    // Scratch for merging the affinities found in each direction.
+    struct MergeBuffers
+    {
+        VecXf psums, qsums;         // Row sums of the push and pull affinities
+        VecXf qflags, tflags;       // Flags on the query and target from the normalised lookups
+        std::vector<int> start;     // Offset of each query row's pull entries (with end sentinel)
+        std::vector<int> next;
+        std::vector<int> tidx;      // Target row of each pull entry
+        std::vector<float> tval;    // Affinity of each pull entry
+    };  // end struct
+
+    // Affinities found in each direction by the last call. Pass the same instance to successive
+    // calls while the points move only a little to warm start the searches from their neighbours.
+    // Each call reuses the storage of the instance (including the merge scratch) where it can.
+    struct WarmStart
+    {
+        EllAffinity push;   // Q x k neighbours on T
+        EllAffinity pull;   // T x k neighbours on Q
+        bool stale = false; // If set, the next call starts cold though still reuses the storage
+        MergeBuffers merge;
+    };  // end struct
+
+    // Sets C to the correspondence features A * Tf for the affinity matrix A that operator() finds
+    // without building A. Each row is normalised, flagged and gathered from the features of the
+    // target points in a single pass over the neighbours found in each direction. Rows for points
+    // of Q without correspondences are taken from Qf instead. The searches are warm started from
+    // (and update) the neighbours found by the last call (starting cold if ws is empty or stale)
+    // with the same result as a cold search. The storage of C is reused if it has the right size.
+    // Qf         : features of the points in Q (one row per point, positions first).
+    // Tf         : features of the points in T with the same columns as Qf.
+    void features( const K3Index& Q, const K3Index& T, const MatXf &Qf, const MatXf &Tf, VecXf &flags,
+                   WarmStart &ws, MatXf &C) const;
+
+    // As above but for when the points of Q have moved since its index was last fit to them with
+    // Qf holding their new positions. Q is refit (see K3Index::refit) while the search from Q to T,
+    // which only needs the positions in Qf, runs concurrently.
+    void refitFeatures( K3Index& Q, const K3Index& T, const MatXf &Qf, const MatXf &Tf, VecXf &flags,
+                        WarmStart &ws, MatXf &C) const;
 
 private:
     size_t _k;
     float _thresh;
     bool _eqpp;
+    size_t _nthreads;
+    float _maxDist;
+
+    void _find( const MatX3fView&, const K3Index&, const K3Index&, WarmStart&, K3Index*) const;
+    void _gather( WarmStart&, const MatXf&, const MatXf&, VecXf&, MatXf&) const;
 };  // end class
 
 }   // end namespace
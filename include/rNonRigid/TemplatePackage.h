@@ -0,0 +1,106 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef RNONRIGID_TEMPLATE_PACKAGE_H
+#define RNONRIGID_TEMPLATE_PACKAGE_H
+
+/**
+ * Everything NonRigidRegistration computes from a floating template before iterating that
+ * depends only on the template: its smoothing weights, the neighbour colouring used to diffuse
+ * outliers, the initial index over its positions and (if asked for on loading) the smoothing
+ * hierarchy for multigrid relaxation. For templates registered against many
+ * targets, the package is built once and saved to a versioned binary file in native byte order.
+ * Loading memory maps the file with the weights and index used in place, so loading only takes a
+ * linear pass to check the neighbour indices and restore the colouring, and pages are shared
+ * by all processes registering the same template. A package may also hold an order for the
+ * template's vertices (see VertexOrder) with everything else then made for them in that order.
+ */
+#include "NeighbourColouring.h"
+#include "SmoothingHierarchy.h"
+#include "VertexOrder.h"
+#include "K3Tree.h"
+
+namespace rNonRigid {
+
+class rNonRigid_EXPORT TemplatePackage
+{
+public:
+    // Build the package for the template with the given positions using K neighbours of each
+    // vertex and smoothing width sigma (smoothK and smoothS of NonRigidRegistration) and save
+    // it to the given file. If reorder is set, the package is made for the vertices put in Morton
+    // order (see VertexOrder) and holds that order. Returns true iff the file was written.
+    static bool save( const std::string &fname, const MatX3fRef &positions, size_t K, float sigma,
+                      size_t numThreads=1, bool reorder=false);
+
+    // Load a package saved by save. Returns null if the file can't be read or wasn't saved by
+    // this version of the library (and platform). A loaded package is read only so may be
+    // shared by any number of registrations running concurrently. If smoothLevels is more
+    // than one, the smoothing hierarchy of up to that many levels (smoothLevels of
+    // NonRigidRegistration) is built from the weights on loading.
+    static std::shared_ptr<TemplatePackage> load( const std::string &fname, size_t numThreads=1,
+                                                  size_t smoothLevels=1);
+
+    inline size_t numPoints() const { return size_t( _swts->indices().rows());}
+    inline size_t K() const { return size_t( _swts->indices().cols());}
+    inline float sigma() const { return _sigma;}
+
+    // Returns true iff the package was made for these positions (in their original order if
+    // the package has a vertex order) and smoothing parameters. The positions may have been
+    // rotated and translated since (e.g. by RigidRegistration without scaling) but not scaled
+    // since the smoothing weights depend on the distances between them.
+    bool matches( const MatX3fRef &positions, size_t K, float sigma) const;
+
+    // Returns the order of the vertices that the weights, colouring and index are in terms of,
+    // or null if they're in the original order.
+    inline const VertexOrder* vertexOrder() const { return _order.get();}
+
+    inline const SmoothingWeights& weights() const { return *_swts;}
+    inline const NeighbourColouring& colouring() const { return _colouring;}
+
+    // Returns the smoothing hierarchy built on loading if it was built with up to maxLevels
+    // levels, or null otherwise.
+    inline const SmoothingHierarchy* hierarchy( size_t maxLevels) const
+    {
+        return maxLevels == _hierarchyLevels ? _hierarchy.get() : nullptr;
+    }   // end hierarchy
+
+    // Returns a new index over the template's positions. Each registration refits its index to
+    // the deforming template so needs its own, but the tree is read from the file until the
+    // first refit copies it (see K3Tree::load).
+    std::shared_ptr<K3Index> newIndex() const;
+
+private:
+    const std::shared_ptr<MappedFile> _file;
+    const size_t _treeOffset;
+    const float _sigma;
+    const size_t _nthreads;
+    std::unique_ptr<const SmoothingWeights> _swts;
+    const NeighbourColouring _colouring;
+    std::shared_ptr<K3Tree> _tree;  // Only used to check matches (over the saved positions)
+    std::unique_ptr<const VertexOrder> _order;
+    const size_t _hierarchyLevels;
+    std::unique_ptr<const SmoothingHierarchy> _hierarchy;
+
+    TemplatePackage( const std::shared_ptr<MappedFile>&, size_t, float, size_t,
+                     SmoothingWeights*, const std::vector<int>&, const std::shared_ptr<K3Tree>&, VertexOrder*, size_t);
+    TemplatePackage( const TemplatePackage&) = delete;
+    TemplatePackage& operator=( const TemplatePackage&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
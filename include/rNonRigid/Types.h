@@ -21,6 +21,8 @@
 #include "rNonRigid_Export.h"
 #include <Eigen/Dense>
 #include <Eigen/SparseCore>
+#include <cassert>
+#include <vector>
 
 #ifdef _WIN32
 // Disable warning about DLL linkage to Eigen library not being exported (it's header only).
@@ -43,8 +45,26 @@ using VecXf = Eigen::VectorXf;                      // Dynamic length vector of
 using MatXf = Eigen::MatrixXf;                      // Dynamic size matrix of floats
 using MatXi = Eigen::MatrixXi;                      // Dynamic size matrix of integers
 
+// Row-major for per row data (e.g. neighbours of each point) read one row at a time.
+using RowMatXi = Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using RowMatXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using RowMatXiView = Eigen::Map<const RowMatXi>;    // Read only views of row-major matrices held
+using RowMatXfView = Eigen::Map<const RowMatXf>;    // elsewhere (e.g. in a memory mapped file)
+
 using SparseMat = Eigen::SparseMatrix<float>;
 
+// Read only view of N x 3 points held elsewhere, e.g. a MatX3f or the position columns of a
+// column-major matrix such as Mesh::features. A view doesn't own the points so their storage
+// must outlive the view (and anything holding the view) without being resized.
+using MatX3fView = Eigen::Map<const MatX3f, 0, Eigen::OuterStride<> >;
+
+// For parameters only read during a call. Binds to a MatX3f, a MatX3fView or the first three
+// columns of a column-major matrix without copying.
+using MatX3fRef = Eigen::Ref<const MatX3f>;
+
+// Returns a view of the given matrix.
+inline MatX3fView viewOf( const MatX3f &m) { return MatX3fView( m.data(), m.rows(), 3, Eigen::OuterStride<>( m.outerStride()));}
+
 
 struct rNonRigid_EXPORT Mesh
 {
@@ -54,9 +74,44 @@ struct rNonRigid_EXPORT Mesh
     MatXf features;    // Features (vertices and normals) per row
     FaceMat topology;  // Face connectivity as row indices into features
 
+    // Returns a copy of the positions (use positionsView to read them in place).
     inline MatX3f positions() const { return features.leftCols<3>();}
-    void update( const MatX3f&);    // Update given the displacement map.
+
+    // Views of the positions and normals in place. Since features is column-major, each
+    // coordinate of the positions (and of the normals) is a contiguous block of floats.
+    // Valid while features is not resized or reassigned.
+    inline MatX3fView positionsView() const
+    {
+        return MatX3fView( features.data(), features.rows(), 3, Eigen::OuterStride<>( features.outerStride()));
+    }   // end positionsView
+
+    inline MatX3fView normalsView() const
+    {
+        assert( features.cols() >= 6);
+        return MatX3fView( features.data() + 3*features.outerStride(), features.rows(), 3, Eigen::OuterStride<>( features.outerStride()));
+    }   // end normalsView
+
+    // Update given the displacement map, recomputing the normals (if features has them) using
+    // up to nthreads threads. The result doesn't depend on the number of threads.
+    void update( const MatX3fRef&, size_t nthreads=1);
     void transform( const Mat4f&);
+
+    // Recompute the area weighted vertex normals from the positions and faces. Each vertex gathers
+    // the normals of its incident faces (in increasing face order) from the vertex to face adjacency
+    // built from topology on first use and kept for subsequent calls.
+    void updateNormals( size_t nthreads=1);
+
+    // The adjacency is rebuilt if the number of vertices or faces changes, but must be discarded
+    // explicitly after reassigning topology with the same number of faces or rewriting its rows
+    // in place (as VertexOrder does). Otherwise the normals are gathered from the old faces.
+    void topologyChanged();
+
+private:
+    std::vector<int> _vfStarts;  // Incident faces of vertex i are _vfaces[_vfStarts[i]] up to
+    std::vector<int> _vfaces;    // _vfaces[_vfStarts[i+1]] (compressed sparse rows).
+    MatX3f _fnrms;               // Per face normals (scratch reused between updates)
+
+    void _buildAdjacency();
 };  // end Mesh
 
 }   // end namespace
@@ -18,33 +18,142 @@
 #ifndef RNONRIGID_VISCO_ELASTIC_TRANSFORMER_H
 #define RNONRIGID_VISCO_ELASTIC_TRANSFORMER_H
 
-#include "SmoothingWeights.h"
+#include "SmoothingHierarchy.h"
+#include "NeighbourColouring.h"
+#include "CompactWeights.h"
 
 namespace rNonRigid {
 
 class rNonRigid_EXPORT ViscoElasticTransformer
 {
 public:
+    // Scratch for update sized on first use and reused by every update after. A workspace may be
+    // passed on to another transformer (once the last is done with it) over the same number of
+    // vertices so that its updates also allocate nothing large.
+    struct Workspace
+    {
+        using Field4 = Eigen::Matrix<float, Eigen::Dynamic, 4, Eigen::RowMajor>;
+        Field4 M, tmp;              // Fields being regularised (with inlier weights in the last column)
+        Field4 acc, t0, t1;         // Chebyshev terms
+        Field4 exact;               // Exact sweeps to measure the approximations against
+        MatX3f prior;               // Total field before the update
+        VecXf mwts, wsums;          // Scaled inlier weights and the modulated smoothing weight sums
+        RowMatXf A;                 // Smoothing operator for the multigrid approximation
+        RowMatXf As;                // Symmetrised smoothing operator for the Chebyshev approximation
+        std::vector<int> outliers;  // Outliers grouped by colour starting at ostarts
+        std::vector<int> ostarts;
+        VecXf owsums;               // Smoothing weight sums of the outliers
+    };  // end struct
+
     // swts : The smoothing weights for the neighbours of the floating vertices in their initial state.
+    // numThreads : number of threads to split the regularisation of the displacement fields and
+    //              the diffusion of outliers over. With one thread, the outliers are diffused in
+    //              place in index order. With more, they're diffused in place a colour at a time
+    //              (see NeighbourColouring) so that results are the same for any number of threads
+    //              above one, but differ slightly from those of one thread.
+    // smoothTol  : if positive, each regularisation of n sweeps is replaced by the lowest degree
+    //              Chebyshev approximation of W^n with error at most this, where W is the smoothing
+    //              operator symmetrised to average over mutual neighbours only (with the same weights
+    //              and row sums as the sweeps otherwise). Unlike the operator of the exact sweeps
+    //              (whose eigenvalues can be complex), W has a real spectrum in [-1,1] so the bound
+    //              holds. Each degree costs about one sweep (see powerApproxDegree). Without the
+    //              neighbours that aren't mutual W smooths less than the exact sweeps, so the result
+    //              differs from theirs by more than this (see measureApproxError).
+    // hierarchy  : if given (built from swts and outliving this object), each regularisation of n
+    //              sweeps is instead approximated by a multigrid V-cycle: a couple of sweeps on
+    //              each level either side of diffusing the restricted field on the next coarser
+    //              level over fewer, cheaper sweeps (as many as spread it as far as the remaining
+    //              sweeps on the level above). This approximates the diffusion rather than W^n
+    //              itself but its cost barely grows with n. Takes precedence over smoothTol.
+    // colouring  : the colouring of swts' neighbours to diffuse the outliers over (outliving this
+    //              object) built once for the template alongside its weights (e.g. by TemplatePackage
+    //              or NonRigidRegistration). If not given, one is made from swts on construction.
+    //              Not used (nor made) with one thread.
+    // workspace  : if given (outliving this object), update uses its scratch rather than its own.
     ViscoElasticTransformer( const SmoothingWeights &swts,
                              size_t numViscousStart, size_t numViscousEnd,
                              size_t numElasticStart, size_t numElasticEnd,
                              size_t numUpdatesTotal,
                              float inlierThresholdWt=0.8f,
-                             size_t numOutlierDiffIts=15);
+                             size_t numOutlierDiffIts=15,
+                             size_t numThreads=1,
+                             float smoothTol=0.0f,
+                             const SmoothingHierarchy *hierarchy=nullptr,
+                             const NeighbourColouring *colouring=nullptr,
+                             Workspace *workspace=nullptr);
+
+    // As above but reading the neighbours and weights from their compact copy (see CompactWeights)
+    // for everything, so the smoothing weights needn't be kept once it's made (nor the hierarchy
+    // once built from them). Each sweep reads half the bytes at the cost of decoding them, and
+    // the weights are quantised to 16 bits so results differ very slightly from those of swts.
+    ViscoElasticTransformer( const CompactWeights &cwts,
+                             size_t numViscousStart, size_t numViscousEnd,
+                             size_t numElasticStart, size_t numElasticEnd,
+                             size_t numUpdatesTotal,
+                             float inlierThresholdWt=0.8f,
+                             size_t numOutlierDiffIts=15,
+                             size_t numThreads=1,
+                             float smoothTol=0.0f,
+                             const SmoothingHierarchy *hierarchy=nullptr,
+                             const NeighbourColouring *colouring=nullptr,
+                             Workspace *workspace=nullptr);
+
+    // As above but reading the smoothing weights a block at a time as they're computed on demand
+    // (see StreamedWeights) to bound the memory they take. The sweeps are always applied exactly.
+    ViscoElasticTransformer( const StreamedWeights &swts,
+                             size_t numViscousStart, size_t numViscousEnd,
+                             size_t numElasticStart, size_t numElasticEnd,
+                             size_t numUpdatesTotal,
+                             float inlierThresholdWt=0.8f,
+                             size_t numOutlierDiffIts=15,
+                             size_t numThreads=1,
+                             const NeighbourColouring *colouring=nullptr,
+                             Workspace *workspace=nullptr);
 
     // Update the displacement field to add for the iteration.
     // iwts : N vector of inlier weights denoting how much each displacement contributes.
     void update( MatX3f&, const VecXf &iwts);
 
+    // Set whether each approximated regularisation (by Chebyshev or V-cycle) is measured against
+    // the exact sweeps it replaces by also applying them to a copy of the field. This costs the
+    // sweeps the approximation saves so is for checking a tolerance or hierarchy (off by default).
+    inline void measureApproxError( bool v) { _measureErr = v;}
+
+    // Returns the largest error of the approximated regularisations of the last update (zero if
+    // none were made). If measured (see measureApproxError), this is the norm of the difference
+    // from the exact sweeps as a proportion of the norm of the field before them. Otherwise, it's
+    // only the truncation error of the Chebyshev approximations: it bounds the error relative to
+    // n applications of the symmetrised W (in the norm weighted by the row sums of W's symmetric
+    // kernel) but not the difference between W and the exact sweeps. V-cycles have no bound.
+    inline float lastApproxError() const { return _approxErr;}
+
+    // Returns the maximum error over [-1,1] of the Chebyshev approximation of x^n of the given degree.
+    static float powerApproxError( size_t n, size_t degree);
+
+    // Returns the lowest degree of Chebyshev approximation of x^n with error at most tol
+    // (n if tol isn't positive).
+    static size_t powerApproxDegree( size_t n, float tol);
+
 private:
-    const SmoothingWeights &_swts;
+    const SmoothingWeights *_swts;  // Either the weights held in memory...
+    const CompactWeights *_cw;      // ...or their compact copy...
+    const StreamedWeights *_stw;    // ...or those computed on demand
     const float _viscousAnnealingRate;
     const float _elasticAnnealingRate;
     const size_t _numViscousStart;
     const size_t _numElasticStart;
     const float _inlierThresholdWt;
     const size_t _numOutlierDiffIts;
+    const size_t _nthreads;
+    const float _smoothTol;
+    const SmoothingHierarchy *_hierarchy;
+    const RowMatXf _symKernel;      // Symmetric kernel of the mutual neighbours (if smoothTol set)
+    std::unique_ptr<const NeighbourColouring> _ownColouring;   // Unless given
+    const NeighbourColouring *_colouring;  // Null with one thread
+    std::unique_ptr<Workspace> _ownWorkspace;   // Unless given
+    Workspace *_ws;
+    bool _measureErr;
+    float _approxErr;
     MatX3f _field;
     float _i;
 };  // end class
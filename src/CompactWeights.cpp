@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <CompactWeights.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+using rNonRigid::CompactWeights;
+using rNonRigid::SmoothingWeights;
+
+
+CompactWeights::CompactWeights( const SmoothingWeights &swts)
+    : _K( swts.indices().cols()), _maxErr(0.0f)
+{
+    const RowMatXiView &nidxs = swts.indices();
+    const RowMatXfView &wts = swts.weights();
+    const size_t N = nidxs.rows();
+    static const float QMAX = float( std::numeric_limits<uint16_t>::max());
+
+    _scale.resize( N);
+    _qwts.resize( N*_K);
+    for ( size_t i = 0; i < N; ++i)
+    {
+        const float wmax = _K > 0 ? wts.row(i).maxCoeff() : 0.0f;
+        _scale[i] = wmax > 0.0f ? wmax / QMAX : 0.0f;
+        for ( size_t k = 0; k < _K; ++k)
+        {
+            const float q = _scale[i] > 0.0f ? std::round( wts(i,k) / _scale[i]) : 0.0f;
+            _qwts[i*_K + k] = uint16_t( std::min( q, QMAX));
+            _maxErr = std::max( _maxErr, std::fabs( _scale[i] * float(_qwts[i*_K + k]) - wts(i,k)));
+        }   // end for
+    }   // end for
+
+    // Only the blocks of narrow offsets take space in _deltas and only the others in _wide.
+    const size_t nblocks = (N + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    _base.resize( nblocks);
+    _start.resize( nblocks);
+    size_t ndeltas = 0, nwide = 0;
+    for ( size_t blk = 0; blk < nblocks; ++blk)
+    {
+        const size_t b = blk * BLOCK_ROWS;
+        const size_t e = std::min( b + BLOCK_ROWS, N);
+        const auto block = nidxs.middleRows( b, e - b);
+        const int base = _K > 0 ? block.minCoeff() : 0;
+        const int span = _K > 0 ? block.maxCoeff() - base : 0;
+        const bool wide = span > int(std::numeric_limits<uint16_t>::max());
+        _base[blk] = wide ? -1 : base;
+        size_t &n = wide ? nwide : ndeltas;
+        _start[blk] = n;
+        n += (e - b)*_K;
+    }   // end for
+
+    _deltas.resize( ndeltas);
+    _wide.resize( nwide);
+    for ( size_t blk = 0; blk < nblocks; ++blk)
+    {
+        const size_t b = blk * BLOCK_ROWS;
+        const size_t e = std::min( b + BLOCK_ROWS, N);
+        const int base = _base[blk];
+        for ( size_t i = b; i < e; ++i)
+        {
+            const size_t off = _start[blk] + (i - b)*_K;
+            for ( size_t k = 0; k < _K; ++k)
+            {
+                if ( base >= 0)
+                    _deltas[off + k] = uint16_t( nidxs(i,k) - base);
+                else
+                    _wide[off + k] = nidxs(i,k);
+            }   // end for
+        }   // end for
+    }   // end for
+}   // end ctor
+
+
+size_t CompactWeights::numWideBlocks() const
+{
+    return size_t( std::count_if( _base.begin(), _base.end(), []( int b){ return b < 0;}));
+}   // end numWideBlocks
+
+
+size_t CompactWeights::bytes() const
+{
+    return _scale.size() * sizeof(float) + _qwts.size() * sizeof(uint16_t)
+         + _base.size() * sizeof(int) + _deltas.size() * sizeof(uint16_t)
+         + _wide.size() * sizeof(int) + _start.size() * sizeof(size_t);
+}   // end bytes
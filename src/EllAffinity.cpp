@@ -0,0 +1,72 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <EllAffinity.h>
+#include <cassert>
+#include <utility>
+#include <vector>
+using rNonRigid::EllAffinity;
+using rNonRigid::SparseMat;
+using rNonRigid::VecXf;
+
+
+EllAffinity::EllAffinity( MatXi &&idxs, MatXf &&vals, size_t ncols)
+    : _idxs( std::move(idxs)), _vals( std::move(vals)), _ncols(ncols)
+{
+    assert( _idxs.rows() == _vals.rows());
+    assert( _idxs.cols() == _vals.cols());
+}   // end ctor
+
+
+VecXf EllAffinity::rowSums() const
+{
+    VecXf rsums;
+    rowSums( rsums);
+    return rsums;
+}   // end rowSums
+
+
+void EllAffinity::rowSums( VecXf &rsums) const
+{
+    rsums.setZero( _vals.rows());
+    for ( long k = 0; k < _vals.cols(); ++k)
+        rsums += _vals.col(k);
+}   // end rowSums
+
+
+void EllAffinity::release( MatXi &idxs, MatXf &vals)
+{
+    idxs.swap( _idxs);
+    vals.swap( _vals);
+    _idxs.resize( 0, 0);
+    _vals.resize( 0, 0);
+    _ncols = 0;
+}   // end release
+
+
+SparseMat EllAffinity::toSparse() const
+{
+    using Triplet = Eigen::Triplet<float>;
+    std::vector<Triplet> tplts;
+    tplts.reserve( _idxs.size());
+    for ( long i = 0; i < _idxs.rows(); ++i)
+        for ( long k = 0; k < _idxs.cols() && _idxs(i,k) >= 0; ++k)
+            tplts.push_back( Triplet( int(i), _idxs(i,k), _vals(i,k)));
+    SparseMat A( _idxs.rows(), _ncols);
+    A.setFromTriplets( tplts.begin(), tplts.end());
+    return A;
+}   // end toSparse
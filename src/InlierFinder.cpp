@@ -29,12 +29,20 @@ InlierFinder::InlierFinder( float k, bool uo, size_t n)
 
 
 VecXf InlierFinder::operator()( const MatXf &rfA, const MatXf &rfB, const VecXf &flags) const
+{
+    VecXf probs, l2sqs;
+    operator()( rfA, rfB, flags, probs, l2sqs);
+    return probs;
+}   // end operator()
+
+
+void InlierFinder::operator()( const MatXf &rfA, const MatXf &rfB, const VecXf &flags, VecXf &probs, VecXf &l2sqs) const
 {
     const size_t N = rfA.rows();
     assert( long(N) == rfB.rows());
     assert( long(N) == flags.size());
 
-    VecXf probs = flags;
+    probs = flags;
 
     // Calculate distance squared deltas over the features. In the original implementation,
     // these values are repeatedly calculated within the _numIterations loop which is inefficient
@@ -45,7 +53,7 @@ VecXf InlierFinder::operator()( const MatXf &rfA, const MatXf &rfB, const VecXf
     // explicitly dealt with separately after the main iteration loop. After having tested taking
     // the difference over the whole feature versus just the position component, the empirical
     // difference is virtually impossible to detect so the more efficient computation is used here.
-    const VecXf l2sqs = (rfB.leftCols<3>() - rfA.leftCols<3>()).rowwise().squaredNorm();
+    l2sqs = (rfB.leftCols<3>() - rfA.leftCols<3>()).rowwise().squaredNorm();
 
     static const float G_CONST = 1.0f/std::sqrt(float(2.0 * EIGEN_PI));
     const float G_FACTOR = G_CONST * std::exp( -0.5f * _kappa * _kappa);
@@ -81,11 +89,9 @@ VecXf InlierFinder::operator()( const MatXf &rfA, const MatXf &rfB, const VecXf
         static const float EPS = 1e-6f;
         static const float ONE_MINUS_EPS = 1.0f - EPS;
         // Scale the dot products of the respective normals to be in [EPS, 1.0f]
-        const VecXf d = ONE_MINUS_EPS * (0.5f * (rfA.rightCols<3>().array() * rfB.rightCols<3>().array()).rowwise().sum() + 0.5f) + EPS;
+        const auto d = ONE_MINUS_EPS * (0.5f * (rfA.rightCols<3>().array() * rfB.rightCols<3>().array()).rowwise().sum() + 0.5f) + EPS;
         //if ( (d.sum() / N) < 0.5f)
         //    std::cerr << "[WARNING] rNonRigid::InlierFinder: Very low inlier weights due to surface normals." << std::endl;
-        probs = probs.array() * d.array();
+        probs.array() *= d;   // Evaluated per element without a temporary
     }   // end if
-
-    return probs;
 }   // end operator()
@@ -0,0 +1,137 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <K3Brute.h>
+#include <KNNResultSet.h>
+#include <Parallel.h>
+#include <algorithm>
+#include <cassert>
+#include <vector>
+using rNonRigid::K3Brute;
+using rNonRigid::KNNResultSet;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatXi;
+using rNonRigid::MatXf;
+using rNonRigid::Vec3f;
+
+
+namespace {
+
+static const int POINT_BLOCK = 256;  // Points checked against each query of a tile at once
+static const int QUERY_TILE = 32;    // Queries checked against each block of points
+
+// Squared distances from a query to a block of points (fixed capacity so lives on the stack).
+using BlockDists = Eigen::Array<float, Eigen::Dynamic, 1, Eigen::ColMajor, POINT_BLOCK, 1>;
+
+
+// Check p against the points in rows [b,b+n) of P.
+void scanBlock( const MatX3f &P, int b, int n, const float *p, KNNResultSet &rset)
+{
+    const BlockDists d = (P.col(0).segment(b,n).array() - p[0]).square()
+                       + (P.col(1).segment(b,n).array() - p[1]).square()
+                       + (P.col(2).segment(b,n).array() - p[2]).square();
+    float worst = rset.worst();
+    for ( int j = 0; j < n; ++j)
+    {
+        if ( d[j] <= worst)
+        {
+            rset.add( size_t(b+j), d[j]);
+            worst = rset.worst();
+        }   // end if
+    }   // end for
+}   // end scanBlock
+
+}   // end namespace
+
+
+K3Brute::K3Brute( const MatX3fRef &m) : _data(m) {}
+
+
+bool K3Brute::refit( const MatX3fRef &m, float)
+{
+    assert( m.rows() == _data.rows());
+    _data = m;
+    return true;
+}   // end refit
+
+
+size_t K3Brute::findn( const Vec3f &p, size_t n, size_t *nv, float *sqd, float maxSqDis) const
+{
+    if ( n == 0)
+        return 0;
+    KNNResultSet rset( n, nv, sqd, maxSqDis);
+    const int N = int(_data.rows());
+    for ( int b = 0; b < N; b += POINT_BLOCK)
+        scanBlock( _data, b, std::min( POINT_BLOCK, N - b), &p[0], rset);
+    return rset.size();
+}   // end findn
+
+
+void K3Brute::findn( const MatX3fRef &Q, size_t n, MatXi &idxs, MatXf &sqdis, size_t nthreads, float maxSqDis) const
+{
+    const size_t NQ = Q.rows();
+    idxs.resize( NQ, n);
+    sqdis.resize( NQ, n);
+    if ( n == 0)
+        return;
+
+    const int N = int(_data.rows());
+    parallelFor( NQ, nthreads, [&]( size_t b, size_t e)
+    {
+        // Results for each query of the current tile persist over all point blocks.
+        std::vector<size_t> nv( QUERY_TILE * n);
+        std::vector<float> sqd( QUERY_TILE * n);
+        std::vector<KNNResultSet> rsets;
+        rsets.reserve( QUERY_TILE);
+
+        for ( size_t t = b; t < e; t += QUERY_TILE)
+        {
+            const int nq = int( std::min<size_t>( QUERY_TILE, e - t));
+            Eigen::Matrix<float, 3, QUERY_TILE> qt;
+            rsets.clear();
+            for ( int q = 0; q < nq; ++q)
+            {
+                qt.col(q) = Q.row(t+q).transpose();
+                rsets.push_back( KNNResultSet( n, &nv[q*n], &sqd[q*n], maxSqDis));
+            }   // end for
+
+            for ( int pb = 0; pb < N; pb += POINT_BLOCK)
+            {
+                const int np = std::min( POINT_BLOCK, N - pb);
+                for ( int q = 0; q < nq; ++q)
+                    scanBlock( _data, pb, np, &qt(0,q), rsets[q]);
+            }   // end for
+
+            for ( int q = 0; q < nq; ++q)
+            {
+                const size_t i = t + q;
+                const size_t found = rsets[q].size();
+                for ( size_t k = 0; k < found; ++k)
+                {
+                    idxs(i,k) = int(nv[q*n + k]);
+                    sqdis(i,k) = sqd[q*n + k];
+                }   // end for
+                for ( size_t k = found; k < n; ++k)
+                {
+                    idxs(i,k) = -1;
+                    sqdis(i,k) = FLT_MAX;
+                }   // end for
+            }   // end for
+        }   // end for
+    }, QUERY_TILE);
+}   // end findn
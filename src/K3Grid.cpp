@@ -0,0 +1,261 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <K3Grid.h>
+#include <KNNResultSet.h>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+using rNonRigid::K3Grid;
+using rNonRigid::KNNResultSet;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatX3fView;
+using rNonRigid::Vec3f;
+
+
+namespace {
+
+static const float POINTS_PER_CELL = 4.0f;  // Mean points per occupied cell when sizing cells automatically
+static const double MAX_CELLS_PER_POINT = 4.0;  // Limits memory used for cells over sparse or volumetric data
+static const int SCAN_BLOCK = 16;   // Number of points in a cell checked against a query at once
+
+// Squared distances from a query to a block of points (fixed capacity so lives on the stack).
+using BlockDists = Eigen::Array<float, Eigen::Dynamic, 1, Eigen::ColMajor, SCAN_BLOCK, 1>;
+
+}   // end namespace
+
+
+class K3Grid::Impl
+{
+public:
+    Impl( const MatX3fRef &m, float csz) : _data(m), _autoSize( csz <= 0.0f), _h(csz)
+    {
+        _build();
+    }   // end ctor
+
+    MatX3fView data() const { return viewOf( _data);}
+
+    float cellSize() const { return _h;}
+
+    void refit( const MatX3fRef &m)
+    {
+        assert( m.rows() == _data.rows());
+        _data = m;
+        _build();
+    }   // end refit
+
+    size_t findn( const Vec3f &p, size_t n, size_t *nearv, float *sqdis, float maxSqDis) const
+    {
+        if ( n == 0 || _data.rows() == 0)
+            return 0;
+
+        KNNResultSet rset( n, nearv, sqdis, maxSqDis);
+        int c[3];   // Cell of the query (or closest cell if the query is outside the grid)
+        for ( int k = 0; k < 3; ++k)
+        {
+            const float v = (p[k] - _lo[k]) * _ih;
+            c[k] = int( std::min( std::max( v, 0.0f), float(_dims[k] - 1)));
+        }   // end for
+
+        for ( int r = 0; ; ++r)
+        {
+            _scanRing( c, r, p, rset);
+
+            // Points in cells beyond ring r are at least as far as the closest face of the block
+            // of cells searched so far (not counting faces already at the edge of the grid).
+            bool more = false;
+            float bound = FLT_MAX;
+            for ( int k = 0; k < 3; ++k)
+            {
+                if ( c[k] - r > 0)
+                {
+                    more = true;
+                    bound = std::min( bound, p[k] - (_lo[k] + (c[k] - r) * _h));
+                }   // end if
+                if ( c[k] + r < _dims[k] - 1)
+                {
+                    more = true;
+                    bound = std::min( bound, _lo[k] + (c[k] + r + 1) * _h - p[k]);
+                }   // end if
+            }   // end for
+
+            if ( !more)
+                break;
+            bound = std::max( bound - _eps, 0.0f);
+            if ( rset.worst() < FLT_MAX && bound*bound > rset.worst())
+                break;
+        }   // end for
+
+        return rset.size();
+    }   // end findn
+
+private:
+    MatX3f _data;               // Points in the order given
+    const bool _autoSize;
+    float _h, _ih;              // Cell size and its inverse
+    float _eps;                 // Slack on cell bounds for rounding when binning points
+    Vec3f _lo;                  // Minimum corner of the grid
+    int _dims[3];               // Number of cells along each axis
+    MatX3f _pts;                // Points sorted by cell
+    std::vector<int> _perm;     // Sorted order to row index of _data
+    std::vector<int> _cellStart;// Offset into _pts of each cell's points (with end sentinel)
+
+    void _build()
+    {
+        const int N = int(_data.rows());
+        _lo = Vec3f::Zero();
+        Vec3f ext = Vec3f::Zero();
+        if ( N > 0)
+        {
+            _lo = _data.colwise().minCoeff();
+            ext = _data.colwise().maxCoeff().transpose() - _lo;
+        }   // end if
+
+        if ( _autoSize)
+        {
+            // Assume the points sample a surface of area roughly half that of the bounding box.
+            const float area = ext[0]*ext[1] + ext[1]*ext[2] + ext[2]*ext[0];
+            _h = std::sqrt( area * POINTS_PER_CELL / std::max( N, 1));
+            if ( _h <= 0.0f)    // Points on a line
+                _h = ext.maxCoeff() * POINTS_PER_CELL / std::max( N, 1);
+        }   // end if
+        if ( _h <= 0.0f)    // All points coincident
+            _h = 1.0f;
+
+        const double maxCells = MAX_CELLS_PER_POINT * N + 64;
+        while ( true)
+        {
+            double ncells = 1;
+            for ( int k = 0; k < 3; ++k)
+            {
+                _dims[k] = int( std::min<double>( std::floor( ext[k] / _h) + 1, maxCells));
+                ncells *= _dims[k];
+            }   // end for
+            if ( ncells <= maxCells)
+                break;
+            _h *= 1.01f * float( std::cbrt( ncells / maxCells));
+        }   // end while
+        _ih = 1.0f / _h;
+        _eps = 1e-4f * _h;
+
+        // Counting sort of the points into their cells.
+        std::vector<int> cellOf( N);
+        _cellStart.assign( size_t(_dims[0]) * _dims[1] * _dims[2] + 1, 0);
+        for ( int i = 0; i < N; ++i)
+        {
+            int c[3];
+            for ( int k = 0; k < 3; ++k)
+                c[k] = std::min( int( (_data(i,k) - _lo[k]) * _ih), _dims[k] - 1);
+            cellOf[i] = _cellIndex( c[0], c[1], c[2]);
+            _cellStart[cellOf[i] + 1]++;
+        }   // end for
+        for ( size_t j = 1; j < _cellStart.size(); ++j)
+            _cellStart[j] += _cellStart[j-1];
+
+        std::vector<int> next( _cellStart.begin(), _cellStart.end() - 1);
+        _perm.resize( N);
+        for ( int i = 0; i < N; ++i)
+            _perm[next[cellOf[i]]++] = i;
+
+        _pts.resize( N, 3);
+        for ( int j = 0; j < N; ++j)
+            _pts.row(j) = _data.row(_perm[j]);
+    }   // end _build
+
+    inline int _cellIndex( int x, int y, int z) const { return (z * _dims[1] + y) * _dims[0] + x;}
+
+    // Scan the cells whose (Chebyshev) distance in cells from c is exactly r.
+    void _scanRing( const int *c, int r, const Vec3f &p, KNNResultSet &rset) const
+    {
+        const int x0 = std::max( c[0] - r, 0), x1 = std::min( c[0] + r, _dims[0] - 1);
+        const int y0 = std::max( c[1] - r, 0), y1 = std::min( c[1] + r, _dims[1] - 1);
+        const int z0 = std::max( c[2] - r, 0), z1 = std::min( c[2] + r, _dims[2] - 1);
+        for ( int z = z0; z <= z1; ++z)
+        {
+            const bool zface = std::abs( z - c[2]) == r;
+            for ( int y = y0; y <= y1; ++y)
+            {
+                if ( zface || std::abs( y - c[1]) == r)
+                {
+                    for ( int x = x0; x <= x1; ++x)
+                        _scanCell( x, y, z, p, rset);
+                }   // end if
+                else
+                {
+                    if ( c[0] - r >= 0)
+                        _scanCell( c[0] - r, y, z, p, rset);
+                    if ( r > 0 && c[0] + r < _dims[0])
+                        _scanCell( c[0] + r, y, z, p, rset);
+                }   // end else
+            }   // end for
+        }   // end for
+    }   // end _scanRing
+
+    void _scanCell( int x, int y, int z, const Vec3f &p, KNNResultSet &rset) const
+    {
+        const int ci = _cellIndex( x, y, z);
+        int b = _cellStart[ci];
+        const int e = _cellStart[ci+1];
+        if ( b == e)
+            return;
+
+        // Skip the cell if it can't contain anything closer than what's already been found.
+        const int c[3] = {x, y, z};
+        float bd = 0.0f;
+        for ( int k = 0; k < 3; ++k)
+        {
+            const float clo = _lo[k] + c[k] * _h - _eps;
+            const float v = std::max( clo - p[k], 0.0f) + std::max( p[k] - clo - _h - 2*_eps, 0.0f);
+            bd += v*v;
+        }   // end for
+        if ( bd > rset.worst())
+            return;
+
+        for ( ; b < e; b += SCAN_BLOCK)
+        {
+            const int n = std::min( SCAN_BLOCK, e - b);
+            const BlockDists d = (_pts.col(0).segment(b,n).array() - p[0]).square()
+                               + (_pts.col(1).segment(b,n).array() - p[1]).square()
+                               + (_pts.col(2).segment(b,n).array() - p[2]).square();
+            for ( int j = 0; j < n; ++j)
+                if ( d[j] <= rset.worst())
+                    rset.add( size_t(_perm[b+j]), d[j]);
+        }   // end for
+    }   // end _scanCell
+};  // end class
+
+
+K3Grid::K3Grid( const MatX3fRef &m, float csz) : _impl( new Impl( m, csz)) {}
+
+K3Grid::~K3Grid() { delete _impl;}
+
+MatX3fView K3Grid::data() const { return _impl->data();}
+
+float K3Grid::cellSize() const { return _impl->cellSize();}
+
+bool K3Grid::refit( const MatX3fRef &m, float)
+{
+    _impl->refit( m);
+    return true;
+}   // end refit
+
+size_t K3Grid::findn( const Vec3f &p, size_t n, size_t *nv, float *sqd, float maxSqDis) const
+{
+    return _impl->findn( p, n, nv, sqd, maxSqDis);
+}   // end findn
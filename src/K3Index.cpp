@@ -0,0 +1,146 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <K3Index.h>
+#include <K3Brute.h>
+#include <K3Tree.h>
+#include <K3Grid.h>
+#include <KDispatch.h>
+#include <Parallel.h>
+#include <algorithm>
+#include <cfloat>
+using rNonRigid::K3Index;
+using rNonRigid::IndexType;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatX3fView;
+using rNonRigid::MatXi;
+using rNonRigid::MatXf;
+
+
+namespace {
+
+// Up to about this many points, exhaustive search is as quick as building and then querying a
+// tree (measured for K=3 and K=80 with as many queries as points). Beyond it the tree wins by a
+// margin that grows with the number of points.
+static const size_t BRUTE_MAX_POINTS = 512;
+
+static const float SEED_RADIUS_PAD = 1e-4f;   // Relative increase of squared search radii set from seeds
+
+
+IndexType chooseType( size_t n, IndexType itype)
+{
+    if ( itype == IndexType::AUTO)
+        itype = n <= BRUTE_MAX_POINTS ? IndexType::BRUTE : IndexType::TREE;
+    return itype;
+}   // end chooseType
+
+}   // end namespace
+
+
+void K3Index::findn( const MatX3fRef &Q, size_t n, MatXi &idxs, MatXf &sqdis, size_t nthreads, float maxSqDis) const
+{
+    const size_t N = Q.rows();
+    idxs.resize( N, n);
+    sqdis.resize( N, n);
+    if ( n == 0)
+        return;
+
+    dispatchK( n, [&]( auto fk)
+    {
+        constexpr size_t K = decltype(fk)::value;
+        parallelFor( N, nthreads, [&]( size_t b, size_t e)
+        {
+            KBuffer<size_t, K> nv(n);
+            KBuffer<float, K> sqd(n);
+            for ( size_t i = b; i < e; ++i)
+            {
+                const size_t found = findn( Q.row(i), numK<K>(n), nv.data(), sqd.data(), maxSqDis);
+                setRow( i, numK<K>(n), found, nv.data(), sqd.data(), idxs, sqdis);
+            }   // end for
+        }, 64);
+    });
+}   // end findn
+
+
+void K3Index::findn( const MatX3fRef &Q, size_t n, const MatXi &seeds,
+                     MatXi &idxs, MatXf &sqdis, size_t nthreads, float maxSqDis) const
+{
+    const size_t N = Q.rows();
+    idxs.resize( N, n);
+    sqdis.resize( N, n);
+    if ( n == 0)
+        return;
+
+    const MatX3fView P = data();
+    dispatchK( n, [&]( auto fk)
+    {
+        constexpr size_t K = decltype(fk)::value;
+        parallelFor( N, nthreads, [&]( size_t b, size_t e)
+        {
+            KBuffer<size_t, K> nv(n);
+            KBuffer<float, K> sqd(n);
+            for ( size_t i = b; i < e; ++i)
+            {
+                // The search radius is the distance to the furthest seed. It's padded a little since
+                // the seed distances may be rounded differently to the same distances in the search.
+                float sqRad = maxSqDis;
+                if ( i < size_t(seeds.rows()))
+                {
+                    size_t nseeds = 0;
+                    float r = 0.0f;
+                    for ( int k = 0; k < seeds.cols(); ++k)
+                    {
+                        const int j = seeds(int(i),k);
+                        if ( j >= 0)
+                        {
+                            r = std::max( r, (P.row(j) - Q.row(i)).squaredNorm());
+                            nseeds++;
+                        }   // end if
+                    }   // end for
+                    if ( nseeds >= n)
+                        sqRad = std::min( sqRad, r * (1.0f + SEED_RADIUS_PAD));
+                }   // end if
+
+                const size_t found = findn( Q.row(i), numK<K>(n), nv.data(), sqd.data(), sqRad);
+                setRow( i, numK<K>(n), found, nv.data(), sqd.data(), idxs, sqdis);
+            }   // end for
+        }, 64);
+    });
+}   // end findn
+
+
+std::shared_ptr<K3Index> rNonRigid::createIndex( const MatX3f &m, IndexType itype, size_t nthreads)
+{
+    itype = chooseType( m.rows(), itype);
+    if ( itype == IndexType::GRID)
+        return std::shared_ptr<K3Index>( new K3Grid(m));
+    if ( itype == IndexType::BRUTE)
+        return std::shared_ptr<K3Index>( new K3Brute(m));
+    return std::shared_ptr<K3Index>( new K3Tree( m, 16, nthreads));
+}   // end createIndex
+
+
+std::shared_ptr<K3Index> rNonRigid::createIndex( const MatX3fView &v, IndexType itype, size_t nthreads)
+{
+    itype = chooseType( v.rows(), itype);
+    if ( itype == IndexType::GRID)
+        return std::shared_ptr<K3Index>( new K3Grid(v));
+    if ( itype == IndexType::BRUTE)
+        return std::shared_ptr<K3Index>( new K3Brute(v));
+    return std::shared_ptr<K3Index>( new K3Tree( v, 16, nthreads));
+}   // end createIndex
@@ -16,53 +16,741 @@
  ************************************************************************/
 
 #include <K3Tree.h>
+#include <KDispatch.h>
+#include <KNNResultSet.h>
+#include <MappedFile.h>
+#include <Parallel.h>
+#include <algorithm>
 #include <cassert>
-#include <nanoflann.hpp>
+#include <cfloat>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <numeric>
+#include <type_traits>
+#include <vector>
 using rNonRigid::K3Tree;
-using rNonRigid::S3Points;
 using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatX3fView;
+using rNonRigid::MatXi;
+using rNonRigid::MatXf;
 using rNonRigid::Vec3f;
 
 
 namespace {
-using MyK3Tree = nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, S3Points<float> >, S3Points<float>, 3>;
+
+static const int MAX_LEAF_SIZE = 64;    // Upper limit on the configurable leaf size
+static const size_t SUBTREES_PER_THREAD = 4;    // Subtrees split off for each thread in parallel builds
+static const int PARALLEL_SPLIT_MIN = 1 << 18;  // Nodes with at least this many points are split by _select
+static const int SPLIT_SAMPLES = 4096;          // Sampled points from which _select chooses its pivots
+static const int SPLIT_MARGIN = 192;            // Sample ranks either side of the median to the pivots
+static const size_t SPLIT_CHUNK = 1 << 14;      // Points per chunk of _select's parallel partition
+
+// Squared distances from a query to each point in a leaf (fixed capacity so lives on the stack).
+using LeafDists = Eigen::Array<float, Eigen::Dynamic, 1, Eigen::ColMajor, MAX_LEAF_SIZE, 1>;
+
+
+struct Node
+{
+    float lo[3];    // Bounding box of the points under this node
+    float hi[3];
+    int begin, end; // Range of the points under this node in leaf order
+    int left;       // Child nodes (both -1 if this is a leaf)
+    int right;
+};  // end struct
+
+static_assert( std::is_trivially_copyable<Node>::value, "Nodes are saved and mapped directly");
+
+
+// Saved trees start with this header. The node array, permutation, leaf ordered points and points
+// in the original order follow in that order at the given offsets (each aligned to FILE_ALIGN bytes).
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // ENDIAN_MARK as written (files are in native byte order)
+    uint32_t nodeSize;      // sizeof(Node)
+    int32_t leafSize;
+    uint64_t numPoints;
+    uint64_t numNodes;
+    float builtQuality;
+    uint32_t reserved;
+    uint64_t nodesOffset;
+    uint64_t permOffset;
+    uint64_t ptsOffset;
+    uint64_t dataOffset;
+};  // end struct
+
+static const char FILE_MAGIC[8] = {'r','N','R','K','3','T','r','e'};
+static const uint32_t FILE_VERSION = 1;
+static const uint32_t ENDIAN_MARK = 0x01020304;
+static const uint64_t FILE_ALIGN = 64;
+
+inline uint64_t alignUp( uint64_t off) { return (off + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;}
+
+
+// Squared distance from p to the closest point of the node's bounding box (zero if p is inside).
+inline float boxSqDist( const Node &nd, const float *p)
+{
+    float d = 0.0f;
+    for ( int c = 0; c < 3; ++c)
+    {
+        const float v = std::max( nd.lo[c] - p[c], 0.0f) + std::max( p[c] - nd.hi[c], 0.0f);
+        d += v*v;
+    }   // end for
+    return d;
+}   // end boxSqDist
+
+
+// Queries trust the nodes of a loaded tree so check that they form a tree over [0,N) stored
+// parent before child, with each child referenced once, the children of each node splitting
+// its range between them, and each leaf holding at most leafSize points.
+bool validNodes( const Node *nodes, size_t numNodes, int N, int leafSize)
+{
+    if ( numNodes == 0 || N == 0)
+        return numNodes == 0 && N == 0;
+    if ( nodes[0].begin != 0 || nodes[0].end != N)
+        return false;
+    std::vector<bool> seen( numNodes, false);
+    seen[0] = true;
+    for ( size_t i = 0; i < numNodes; ++i)
+    {
+        const Node &nd = nodes[i];
+        if ( !seen[i] || nd.begin < 0 || nd.begin >= nd.end || nd.end > N)
+            return false;
+        if ( nd.left < 0 || nd.right < 0)
+        {
+            if ( nd.left != -1 || nd.right != -1 || nd.end - nd.begin > leafSize)
+                return false;
+            continue;
+        }   // end if
+        if ( size_t(nd.left) <= i || size_t(nd.left) >= numNodes || size_t(nd.right) <= i || size_t(nd.right) >= numNodes
+                || seen[nd.left] || seen[nd.right] || nd.left == nd.right)
+            return false;
+        const Node &l = nodes[nd.left];
+        const Node &r = nodes[nd.right];
+        if ( l.begin != nd.begin || l.end != r.begin || r.end != nd.end)
+            return false;
+        seen[nd.left] = seen[nd.right] = true;
+    }   // end for
+    return true;
+}   // end validNodes
+
+
+// Check perm holds every index in [0,N) exactly once.
+bool validPerm( const int *perm, int N)
+{
+    std::vector<bool> seen( size_t(N), false);
+    for ( int i = 0; i < N; ++i)
+    {
+        if ( perm[i] < 0 || perm[i] >= N || seen[perm[i]])
+            return false;
+        seen[perm[i]] = true;
+    }   // end for
+    return true;
+}   // end validPerm
+
 }   // end namespace
 
 
 class K3Tree::Impl
 {
 public:
-    explicit Impl( const MatX3f &m) : _pcloud(m)
+    // If copy is false, the tree references the viewed points rather than keeping its own copy.
+    Impl( const MatX3fView &v, bool copy, size_t lsz, size_t nthreads)
+        : _data( v), _perm( v.rows()), _leafSize( int( std::min<size_t>( std::max<size_t>( lsz, 1), MAX_LEAF_SIZE))),
+          _nthreads( std::max<size_t>( nthreads, 1))
+    {
+        if ( copy)
+            _setOwn( v);
+        std::iota( _perm.begin(), _perm.end(), 0);
+        _rebuild();
+    }   // end ctor
+
+    // Use the tree saved at the given offset in the given file in place. The header must have been validated.
+    Impl( const std::shared_ptr<MappedFile> &file, size_t offset, size_t nthreads)
+        : _data( nullptr, 0, 3, Eigen::OuterStride<>(0)), _file( file),
+          _leafSize( reinterpret_cast<const FileHeader*>( file->data() + offset)->leafSize), _nthreads( std::max<size_t>( nthreads, 1))
     {
-        assert( m.cols() == 3);
-        _kdtree = new MyK3Tree( (int)m.cols(), _pcloud, nanoflann::KDTreeSingleIndexAdaptorParams(15));
-        _kdtree->buildIndex();
+        const char *base = file->data() + offset;
+        const FileHeader &hdr = *reinterpret_cast<const FileHeader*>( base);
+        const Eigen::Index N = Eigen::Index( hdr.numPoints);
+        new (&_data) MatX3fView( reinterpret_cast<const float*>( base + hdr.dataOffset), N, 3, Eigen::OuterStride<>(N));
+        new (&_ptsv) MatX3fView( reinterpret_cast<const float*>( base + hdr.ptsOffset), N, 3, Eigen::OuterStride<>(N));
+        _nodesp = reinterpret_cast<const Node*>( base + hdr.nodesOffset);
+        _numNodes = size_t( hdr.numNodes);
+        _permp = reinterpret_cast<const int*>( base + hdr.permOffset);
+        _builtQuality = hdr.builtQuality;
+        _mapped = true;
     }   // end ctor
 
-    ~Impl() { delete _kdtree;}
+    bool save( std::ostream &ofs) const
+    {
+        const uint64_t N = uint64_t( _data.rows());
+        FileHeader hdr;
+        std::memset( &hdr, 0, sizeof(FileHeader));
+        std::memcpy( hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+        hdr.version = FILE_VERSION;
+        hdr.byteOrder = ENDIAN_MARK;
+        hdr.nodeSize = uint32_t( sizeof(Node));
+        hdr.leafSize = _leafSize;
+        hdr.numPoints = N;
+        hdr.numNodes = uint64_t( _numNodes);
+        hdr.builtQuality = _builtQuality;
+        hdr.nodesOffset = alignUp( sizeof(FileHeader));
+        hdr.permOffset = alignUp( hdr.nodesOffset + _numNodes * sizeof(Node));
+        hdr.ptsOffset = alignUp( hdr.permOffset + N * sizeof(int));
+        hdr.dataOffset = alignUp( hdr.ptsOffset + 3 * N * sizeof(float));
+
+        const uint64_t start = uint64_t( ofs.tellp());
+        const auto writeAt = [&]( uint64_t off, const void *p, uint64_t nbytes)
+        {
+            static const char zeros[FILE_ALIGN] = {};
+            ofs.write( zeros, std::streamsize( start + off - uint64_t( ofs.tellp())));
+            ofs.write( static_cast<const char*>( p), std::streamsize( nbytes));
+        };  // end writeAt
+
+        ofs.write( reinterpret_cast<const char*>( &hdr), sizeof(FileHeader));
+        writeAt( hdr.nodesOffset, _nodesp, _numNodes * sizeof(Node));
+        writeAt( hdr.permOffset, _permp, N * sizeof(int));
+        for ( int c = 0; c < 3 && N > 0; ++c)
+            writeAt( hdr.ptsOffset + c * N * sizeof(float), _ptsv.col(c).data(), N * sizeof(float));
+        for ( int c = 0; c < 3 && N > 0; ++c)
+        {
+            const Eigen::VectorXf col = _data.col(c);  // Viewed columns may not be contiguous with each other
+            writeAt( hdr.dataOffset + c * N * sizeof(float), col.data(), N * sizeof(float));
+        }   // end for
+        return bool(ofs);
+    }   // end save
 
-    const MatX3f& data() const { return _pcloud.model();}
+    const MatX3fView& data() const { return _data;}
 
-    size_t findn( const Vec3f& p, size_t n, size_t *nearv, float *sqdis) const
+    bool refit( const MatX3fRef &m, float maxGrowth)
     {
-        if ( n == 0)
+        assert( m.rows() == _data.rows());
+        // Points already in the referenced storage (updated in place) don't need copying.
+        if ( m.data() != _data.data() || m.outerStride() != _data.outerStride())
+            _setOwn( m);
+
+        // A tree loaded from file needs its own copy of the structure to update.
+        if ( _mapped)
+        {
+            _nodes.assign( _nodesp, _nodesp + _numNodes);
+            _perm.assign( _permp, _permp + _data.rows());
+            _mapped = false;
+        }   // end if
+        _reorder();
+
+        // Nodes are stored parent before child so update the bounds from the back.
+        for ( int ni = int(_nodes.size()) - 1; ni >= 0; --ni)
+        {
+            Node &nd = _nodes[ni];
+            if ( nd.left < 0)
+                _setLeafBounds( nd);
+            else
+            {
+                const Node &l = _nodes[nd.left];
+                const Node &r = _nodes[nd.right];
+                for ( int c = 0; c < 3; ++c)
+                {
+                    nd.lo[c] = std::min( l.lo[c], r.lo[c]);
+                    nd.hi[c] = std::max( l.hi[c], r.hi[c]);
+                }   // end for
+            }   // end else
+        }   // end for
+
+        if ( _quality() <= maxGrowth * _builtQuality)
+            return false;
+        _rebuild();
+        return true;
+    }   // end refit
+
+    // Find the n closest points to p. If leaf is not negative, that leaf is searched first to
+    // tighten the search bounds. On return, leaf is set to the leaf holding the closest point.
+    size_t findn( const Vec3f &p, size_t n, size_t *nearv, float *sqdis, float maxSqDis, int &leaf) const
+    {
+        if ( n == 0 || _numNodes == 0)
             return 0;
-        return _kdtree->knnSearch( &p(0), n, nearv, sqdis);
+        KNNResultSet rset( n, nearv, sqdis, maxSqDis);
+        const int seed = leaf;
+        if ( seed >= 0)
+            _scanLeaf( seed, &p[0], rset, leaf);
+        _search( 0, &p[0], rset, seed, leaf);
+        return rset.size();
     }   // end findn
 
 private:
-    const S3Points<float> _pcloud;
-    MyK3Tree *_kdtree;
+    MatX3f _own;            // Copy of the points if not referencing the caller's
+    MatX3fView _data;       // Points in the order given (either _own, the caller's or the file's)
+    MatX3f _pts;            // Points in leaf order
+    std::vector<int> _perm; // Leaf order to row index of _data
+    std::vector<Node> _nodes;
+    float _builtQuality;    // Value of _quality() at the last full build
+
+    // Queries use these which point either to the members above or into the mapped file.
+    std::shared_ptr<MappedFile> _file;
+    bool _mapped = false;   // True iff the nodes and permutation are the file's
+    const Node *_nodesp = nullptr;
+    size_t _numNodes = 0;
+    const int *_permp = nullptr;
+    MatX3fView _ptsv = MatX3fView( nullptr, 0, 3, Eigen::OuterStride<>(0));
+
+    const int _leafSize;
+    const size_t _nthreads;
+
+    void _setOwn( const MatX3fRef &m)
+    {
+        _own = m;
+        new (&_data) MatX3fView( viewOf( _own)); // Rebinding a Map is done by placement new
+    }   // end _setOwn
+
+    void _rebuild()
+    {
+        const int N = int(_data.rows());
+        _nodes.clear();
+        if ( N > 0)
+        {
+            _nodes.reserve( 4 * (N / _leafSize + 1));
+            if ( _nthreads > 1)
+                _buildParallel();
+            else
+                _build( _nodes, 0, N);
+        }   // end if
+        _reorder();
+        _builtQuality = _quality();
+    }   // end _rebuild
+
+    // Copy the points in leaf order so each leaf's coordinates are contiguous per column.
+    void _reorder()
+    {
+        const int N = int(_data.rows());
+        _pts.resize( N, 3);
+        parallelFor( size_t(N), _nthreads, [this]( size_t b, size_t e)
+        {
+            for ( size_t j = b; j < e; ++j)
+                _pts.row(j) = _data.row(_perm[j]);
+        }, 4096);
+
+        _nodesp = _nodes.data();
+        _numNodes = _nodes.size();
+        _permp = _perm.data();
+        new (&_ptsv) MatX3fView( viewOf( _pts));
+    }   // end _reorder
+
+    void _setLeafBounds( Node &nd) const
+    {
+        const int b = nd.begin;
+        const int c = nd.end - b;
+        for ( int k = 0; k < 3; ++k)
+        {
+            nd.lo[k] = _pts.col(k).segment(b,c).minCoeff();
+            nd.hi[k] = _pts.col(k).segment(b,c).maxCoeff();
+        }   // end for
+    }   // end _setLeafBounds
+
+    // Sum of the leaf extents (sum of the side lengths of each leaf's bounding box) relative
+    // to the extent of the root. Growth in this measure indicates leaves spreading out and
+    // overlapping so that queries have to visit more of them.
+    float _quality() const
+    {
+        if ( _nodes.empty())
+            return 0.0f;
+        const auto extent = []( const Node &nd)
+        {
+            return (nd.hi[0] - nd.lo[0]) + (nd.hi[1] - nd.lo[1]) + (nd.hi[2] - nd.lo[2]);
+        };  // end extent
+        float sum = 0.0f;
+        for ( const Node &nd : _nodes)
+            if ( nd.left < 0)
+                sum += extent( nd);
+        return sum / std::max( extent( _nodes[0]), FLT_MIN);
+    }   // end _quality
+
+    // Set the bounds and range of a node over the leaf ordered points in [b,e) as a leaf.
+    // Large ranges are bounded in chunks using up to nthreads threads.
+    void _initNode( Node &nd, int b, int e, size_t nthreads=1) const
+    {
+        const auto bound = [this]( float *lo, float *hi, int j0, int j1)
+        {
+            for ( int c = 0; c < 3; ++c)
+            {
+                lo[c] = FLT_MAX;
+                hi[c] = -FLT_MAX;
+            }   // end for
+            for ( int j = j0; j < j1; ++j)
+            {
+                for ( int c = 0; c < 3; ++c)
+                {
+                    const float v = _data(_perm[j], c);
+                    lo[c] = std::min( lo[c], v);
+                    hi[c] = std::max( hi[c], v);
+                }   // end for
+            }   // end for
+        };  // end bound
+
+        if ( nthreads > 1 && e - b >= PARALLEL_SPLIT_MIN)
+        {
+            const size_t n = size_t(e - b);
+            const size_t nchunks = (n + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+            std::vector<float> bnds( 6*nchunks);
+            parallelFor( nchunks, nthreads, [&]( size_t c0, size_t c1)
+            {
+                for ( size_t c = c0; c < c1; ++c)
+                    bound( &bnds[6*c], &bnds[6*c+3], b + int(c * SPLIT_CHUNK), b + int( std::min( (c+1) * SPLIT_CHUNK, n)));
+            }, 1);
+            bound( nd.lo, nd.hi, 0, 0);
+            for ( size_t c = 0; c < nchunks; ++c)
+            {
+                for ( int k = 0; k < 3; ++k)
+                {
+                    nd.lo[k] = std::min( nd.lo[k], bnds[6*c+k]);
+                    nd.hi[k] = std::max( nd.hi[k], bnds[6*c+3+k]);
+                }   // end for
+            }   // end for
+        }   // end if
+        else
+            bound( nd.lo, nd.hi, b, e);
+
+        nd.begin = b;
+        nd.end = e;
+        nd.left = nd.right = -1;
+    }   // end _initNode
+
+    // Partition the node's points at the median along the dimension of greatest extent
+    // and return the start of the upper half. Only touches the node's range of _perm.
+    // Ranges of at least PARALLEL_SPLIT_MIN points are partitioned by _select using up to
+    // nthreads threads (the partition is the same whatever the number of threads).
+    int _split( const Node &nd, size_t nthreads)
+    {
+        int dim = 0;
+        for ( int c = 1; c < 3; ++c)
+            if ( nd.hi[c] - nd.lo[c] > nd.hi[dim] - nd.lo[dim])
+                dim = c;
+        const int mid = nd.begin + (nd.end - nd.begin)/2;
+        if ( nd.end - nd.begin >= PARALLEL_SPLIT_MIN)
+            _select( dim, nd.begin, mid, nd.end, nthreads);
+        else
+        {
+            std::nth_element( _perm.begin() + nd.begin, _perm.begin() + mid, _perm.begin() + nd.end,
+                              [&]( int i, int j){ return _data(i,dim) < _data(j,dim);});
+        }   // end else
+        return mid;
+    }   // end _split
+
+    // Rearrange _perm in [b,e) so that the points before k are those less than the point at k
+    // along dim (ordered by coordinate then by row to make the order total). Pivots bracketing
+    // k's rank are taken from a sorted sample of the range, and the range is partitioned stably
+    // in parallel into the points below, between and above them. The points between are far
+    // fewer and are narrowed in the same way until few enough for nth_element. The stable
+    // partition of fixed size chunks doesn't depend on the number of threads.
+    void _select( int dim, int b, int k, int e, size_t nthreads)
+    {
+        const auto less = [this, dim]( int i, int j)
+        {
+            const float vi = _data(i,dim);
+            const float vj = _data(j,dim);
+            return vi < vj || (vi == vj && i < j);
+        };  // end less
+
+        std::vector<int> tmp;
+        std::vector<uint8_t> parts;  // Part of each point (so coordinates are only gathered once)
+        std::vector<int> sample( SPLIT_SAMPLES);
+        while ( e - b >= PARALLEL_SPLIT_MIN)
+        {
+            const size_t n = size_t(e - b);
+            for ( int s = 0; s < SPLIT_SAMPLES; ++s)
+                sample[s] = _perm[b + size_t(s) * n / SPLIT_SAMPLES];
+            std::sort( sample.begin(), sample.end(), less);
+            const int r = int( size_t(k - b) * SPLIT_SAMPLES / n);
+            const int lo = sample[std::max( r - SPLIT_MARGIN, 0)];
+            const int hi = sample[std::min( r + SPLIT_MARGIN, SPLIT_SAMPLES - 1)];
+            const auto part = [&]( int i) { return less( i, lo) ? 0 : less( hi, i) ? 2 : 1;};
+
+            // Count each chunk's points in each part then scatter them stably into tmp.
+            const size_t nchunks = (n + SPLIT_CHUNK - 1) / SPLIT_CHUNK;
+            parts.resize( n);
+            std::vector<size_t> offs( 3 * nchunks + 3, 0);
+            parallelFor( nchunks, nthreads, [&]( size_t c0, size_t c1)
+            {
+                for ( size_t c = c0; c < c1; ++c)
+                {
+                    const int j1 = b + int( std::min( (c+1) * SPLIT_CHUNK, n));
+                    for ( int j = b + int(c * SPLIT_CHUNK); j < j1; ++j)
+                    {
+                        parts[j-b] = uint8_t( part( _perm[j]));
+                        offs[3*(c+1) + parts[j-b]]++;
+                    }   // end for
+                }   // end for
+            }, 1);
+            size_t tot[3] = {0,0,0};
+            for ( size_t c = 1; c <= nchunks; ++c)
+                for ( int p = 0; p < 3; ++p)
+                {
+                    const size_t cnt = offs[3*c + p];
+                    offs[3*c + p] = tot[p];
+                    tot[p] += cnt;
+                }   // end for
+
+            const int m0 = b + int(tot[0]);
+            const int m1 = m0 + int(tot[1]);
+            if ( k < m0 || k >= m1)   // Sample unrepresentative (very unlikely) so finish serially
+                break;
+
+            tmp.resize( n);
+            parallelFor( nchunks, nthreads, [&]( size_t c0, size_t c1)
+            {
+                for ( size_t c = c0; c < c1; ++c)
+                {
+                    size_t o[3] = { offs[3*(c+1)], tot[0] + offs[3*(c+1) + 1], tot[0] + tot[1] + offs[3*(c+1) + 2]};
+                    const int j1 = b + int( std::min( (c+1) * SPLIT_CHUNK, n));
+                    for ( int j = b + int(c * SPLIT_CHUNK); j < j1; ++j)
+                        tmp[o[parts[j-b]]++] = _perm[j];
+                }   // end for
+            }, 1);
+            parallelFor( n, nthreads, [&]( size_t j0, size_t j1)
+            {
+                std::copy( tmp.begin() + j0, tmp.begin() + j1, _perm.begin() + b + j0);
+            }, SPLIT_CHUNK);
+
+            b = m0;
+            e = m1;
+        }   // end while
+
+        std::nth_element( _perm.begin() + b, _perm.begin() + k, _perm.begin() + e, less);
+    }   // end _select
+
+    // Create the subtree over the leaf ordered points in [b,e) in the given node
+    // array (parent before child) and return the index of its root.
+    int _build( std::vector<Node> &nodes, int b, int e)
+    {
+        const int ni = int(nodes.size());
+        nodes.push_back( Node());
+
+        Node nd;
+        _initNode( nd, b, e);
+        if ( e - b > _leafSize)
+        {
+            const int mid = _split( nd, 1);
+            nd.left = _build( nodes, b, mid);
+            nd.right = _build( nodes, mid, e);
+        }   // end if
+
+        nodes[ni] = nd;
+        return ni;
+    }   // end _build
+
+    // Split the top of the tree one level at a time with the nodes of each level split
+    // concurrently (or the nodes of the first levels split one at a time each using all
+    // the threads) until there are enough subtrees to share between the threads. Each
+    // subtree is then built into its own node array on a single thread and the arrays
+    // are appended in order. Nodes are partitioned exactly as in the serial build so
+    // the leaf order and hence the query results are the same for any thread count.
+    void _buildParallel()
+    {
+        _nodes.resize(1);
+        _initNode( _nodes[0], 0, int(_data.rows()), _nthreads);
+
+        std::vector<int> level( 1, 0);
+        while ( !level.empty() && level.size() < SUBTREES_PER_THREAD * _nthreads)
+        {
+            std::vector<int> next;
+            for ( int ni : level)
+            {
+                if ( _nodes[ni].end - _nodes[ni].begin > _leafSize)
+                {
+                    _nodes[ni].left = int(_nodes.size());
+                    _nodes[ni].right = int(_nodes.size()) + 1;
+                    next.push_back( _nodes[ni].left);
+                    next.push_back( _nodes[ni].right);
+                    _nodes.resize( _nodes.size() + 2);
+                }   // end if
+            }   // end for
+
+            // While there are fewer nodes than threads, each node is split using all the threads.
+            const size_t nt = level.size() < _nthreads ? _nthreads : 1;
+            parallelFor( level.size(), nt == 1 ? _nthreads : 1, [&]( size_t b, size_t e)
+            {
+                for ( size_t i = b; i < e; ++i)
+                {
+                    const Node &nd = _nodes[level[i]];
+                    if ( nd.left < 0)
+                        continue;
+                    const int mid = _split( nd, nt);
+                    _initNode( _nodes[nd.left], nd.begin, mid, nt);
+                    _initNode( _nodes[nd.right], mid, nd.end, nt);
+                }   // end for
+            }, 1);
+
+            level.swap( next);
+        }   // end while
+
+        std::vector<std::vector<Node> > subtrees( level.size());
+        parallelFor( level.size(), _nthreads, [&]( size_t b, size_t e)
+        {
+            for ( size_t i = b; i < e; ++i)
+            {
+                const Node &nd = _nodes[level[i]];
+                subtrees[i].reserve( 4 * ((nd.end - nd.begin) / _leafSize + 1));
+                _build( subtrees[i], nd.begin, nd.end);
+            }   // end for
+        }, 1);
+
+        // The root of each subtree replaces its placeholder and the rest are appended after
+        // the existing nodes with their child indices offset to match.
+        for ( size_t i = 0; i < level.size(); ++i)
+        {
+            std::vector<Node> &sub = subtrees[i];
+            const int off = int(_nodes.size()) - 1;
+            for ( Node &nd : sub)
+            {
+                if ( nd.left >= 0)
+                {
+                    nd.left += off;
+                    nd.right += off;
+                }   // end if
+            }   // end for
+            _nodes[level[i]] = sub[0];
+            _nodes.insert( _nodes.end(), sub.begin() + 1, sub.end());
+        }   // end for
+    }   // end _buildParallel
+
+    // Check p against every point in the given leaf at once.
+    void _scanLeaf( int ni, const float *p, KNNResultSet &rset, int &leaf) const
+    {
+        const Node &nd = _nodesp[ni];
+        const int b = nd.begin;
+        const int c = nd.end - b;
+        const LeafDists d = (_ptsv.col(0).segment(b,c).array() - p[0]).square()
+                          + (_ptsv.col(1).segment(b,c).array() - p[1]).square()
+                          + (_ptsv.col(2).segment(b,c).array() - p[2]).square();
+        for ( int j = 0; j < c; ++j)
+            if ( d[j] <= rset.worst() && rset.add( size_t(_permp[b+j]), d[j]))
+                leaf = ni;
+    }   // end _scanLeaf
+
+    // Descend into the closer child first and only visit children that may hold closer points.
+    void _search( int ni, const float *p, KNNResultSet &rset, int skip, int &leaf) const
+    {
+        const Node &nd = _nodesp[ni];
+        if ( nd.left < 0)
+        {
+            if ( ni != skip)
+                _scanLeaf( ni, p, rset, leaf);
+            return;
+        }   // end if
+
+        int a = nd.left;
+        int b = nd.right;
+        float da = boxSqDist( _nodesp[a], p);
+        float db = boxSqDist( _nodesp[b], p);
+        if ( db < da)
+        {
+            std::swap( a, b);
+            std::swap( da, db);
+        }   // end if
+
+        if ( da <= rset.worst())
+            _search( a, p, rset, skip, leaf);
+        if ( db <= rset.worst())
+            _search( b, p, rset, skip, leaf);
+    }   // end _search
 };  // end class
 
 
-K3Tree::K3Tree( const MatX3f& m) : _impl( new Impl(m)) {}
+K3Tree::K3Tree( const MatX3f& m, size_t leafSize, size_t nthreads)
+    : _impl( new Impl( viewOf(m), true, leafSize, nthreads)) {}
+
+K3Tree::K3Tree( const MatX3fView& v, size_t leafSize, size_t nthreads)
+    : _impl( new Impl( v, false, leafSize, nthreads)) {}
+
+K3Tree::K3Tree( Impl *impl) : _impl( impl) {}
 
 K3Tree::~K3Tree() { delete _impl;}
 
-const MatX3f& K3Tree::data() const { return _impl->data();}
+bool K3Tree::save( const std::string &fname) const
+{
+    std::ofstream ofs( fname, std::ios::binary);
+    return save( ofs);
+}   // end save
+
+
+bool K3Tree::save( std::ostream &ofs) const { return _impl->save( ofs);}
+
+size_t K3Tree::fileAlignment() { return size_t( FILE_ALIGN);}
 
-size_t K3Tree::findn( const Vec3f& p, size_t n, size_t *nv, float *sqd) const
+
+std::shared_ptr<K3Tree> K3Tree::load( const std::string &fname, size_t nthreads)
+{
+    const std::shared_ptr<MappedFile> file = MappedFile::open( fname);
+    return file ? load( file, 0, nthreads) : nullptr;
+}   // end load
+
+
+std::shared_ptr<K3Tree> K3Tree::load( const std::shared_ptr<MappedFile> &file, size_t offset, size_t nthreads)
 {
-    return _impl->findn( p, n, nv, sqd);
+    if ( offset % FILE_ALIGN != 0 || offset > file->size() || file->size() - offset < sizeof(FileHeader))
+        return nullptr;
+    const uint64_t fsize = file->size() - offset;
+
+    const FileHeader &hdr = *reinterpret_cast<const FileHeader*>( file->data() + offset);
+    if ( std::memcmp( hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0
+            || hdr.version != FILE_VERSION || hdr.byteOrder != ENDIAN_MARK || hdr.nodeSize != sizeof(Node))
+        return nullptr;
+
+    // Check the sections are where they should be and fit within the file.
+    const uint64_t N = hdr.numPoints;
+    if ( hdr.nodesOffset != alignUp( sizeof(FileHeader))
+            || hdr.permOffset != alignUp( hdr.nodesOffset + hdr.numNodes * sizeof(Node))
+            || hdr.ptsOffset != alignUp( hdr.permOffset + N * sizeof(int))
+            || hdr.dataOffset != alignUp( hdr.ptsOffset + 3 * N * sizeof(float))
+            || hdr.dataOffset + 3 * N * sizeof(float) > fsize
+            || hdr.leafSize < 1 || hdr.leafSize > MAX_LEAF_SIZE
+            || N > uint64_t( INT_MAX) || hdr.numNodes > 2*N)
+        return nullptr;
+
+    const char *base = file->data() + offset;
+    if ( !validNodes( reinterpret_cast<const Node*>( base + hdr.nodesOffset), size_t( hdr.numNodes), int(N), hdr.leafSize)
+            || !validPerm( reinterpret_cast<const int*>( base + hdr.permOffset), int(N)))
+        return nullptr;
+
+    return std::shared_ptr<K3Tree>( new K3Tree( new Impl( file, offset, nthreads)));
+}   // end load
+
+MatX3fView K3Tree::data() const { return _impl->data();}
+
+bool K3Tree::refit( const MatX3fRef &m, float maxGrowth) { return _impl->refit( m, maxGrowth);}
+
+size_t K3Tree::findn( const Vec3f& p, size_t n, size_t *nv, float *sqd, float maxSqDis) const
+{
+    int leaf = -1;
+    return _impl->findn( p, n, nv, sqd, maxSqDis, leaf);
+}   // end findn
+
+
+void K3Tree::findn( const MatX3fRef &Q, size_t n, MatXi &idxs, MatXf &sqdis, size_t nthreads, float maxSqDis) const
+{
+    const size_t N = Q.rows();
+    idxs.resize( N, n);
+    sqdis.resize( N, n);
+    if ( n == 0)
+        return;
+
+    dispatchK( n, [&]( auto fk)
+    {
+        constexpr size_t K = decltype(fk)::value;
+        parallelFor( N, nthreads, [&]( size_t b, size_t e)
+        {
+            KBuffer<size_t, K> nv(n);
+            KBuffer<float, K> sqd(n);
+            int leaf = -1;  // Consecutive queries in this chunk start from the last query's leaf
+            for ( size_t i = b; i < e; ++i)
+            {
+                const size_t found = _impl->findn( Q.row(i), numK<K>(n), nv.data(), sqd.data(), maxSqDis, leaf);
+                setRow( i, numK<K>(n), found, nv.data(), sqd.data(), idxs, sqdis);
+            }   // end for
+        }, 64);
+    });
 }   // end findn
@@ -16,11 +16,19 @@
  ************************************************************************/
 
 #include <KNNCorresponder.h>
+#include <KDispatch.h>
+#include <Parallel.h>
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <utility>
 using rNonRigid::KNNCorresponder;
+using rNonRigid::EllAffinity;
 using rNonRigid::SparseMat;
-using rNonRigid::K3Tree;
-using rNonRigid::MatX3f;
+using rNonRigid::K3Index;
+using rNonRigid::MatX3fView;
+using rNonRigid::MatXi;
+using rNonRigid::MatXf;
 using rNonRigid::VecXf;
 
 
@@ -51,49 +59,76 @@ SparseMat rNonRigid::normaliseRows( const SparseMat& m)
 }   // end normaliseRows
 
 
-KNNCorresponder::KNNCorresponder( const MatX3f &m, size_t k) : _qry(m), _k(k)
+KNNCorresponder::KNNCorresponder( const MatX3fView &m, size_t k, size_t nthreads, float maxDist)
+    : _qry(m), _k(k), _nthreads(nthreads), _maxSqDis( maxDist > 0.0f ? maxDist*maxDist : FLT_MAX)
 {
     assert( k < size_t(m.rows()));
     assert( k >= 1);
 }   // end ctor
 
 
-SparseMat KNNCorresponder::find( const K3Tree& kdt) const
+SparseMat KNNCorresponder::find( const K3Index& kdt) const
+{
+    // For each floating vertex, find the K nearest vertices on the target
+    MatXi kverts;   // K closest vertices on the target model per query row.
+    MatXf sqdis;    // Corresponding squared distances of each closest vertex to the search vertex
+    kdt.findn( _qry, _k, kverts, sqdis, _nthreads, _maxSqDis);
+    return _affinities( kdt, kverts, sqdis).toSparse();
+}   // end find
+
+
+void KNNCorresponder::affinities( const K3Index& kdt, EllAffinity &A, bool warm) const
+{
+    MatXi kverts;
+    MatXf sqdis;
+    A.release( kverts, sqdis);
+    // Warm started, the neighbours are found in place of the previous ones (see K3Index::findn).
+    if ( warm && kverts.rows() == _qry.rows() && kverts.cols() == long(_k))
+        kdt.findn( _qry, _k, kverts, kverts, sqdis, _nthreads, _maxSqDis);
+    else
+        kdt.findn( _qry, _k, kverts, sqdis, _nthreads, _maxSqDis);
+    A = _affinities( kdt, kverts, sqdis);
+}   // end affinities
+
+
+EllAffinity KNNCorresponder::_affinities( const K3Index& kdt, MatXi &kverts, MatXf &sqdis) const
 {
     const size_t K = _k;
     const size_t n = _qry.rows();          // # query vertices
     const size_t m = kdt.data().rows();    // # target vertices
     assert( K < m);
 
-    static const float EPS = 1e-6f; // Required in the case of any distance == 0 to prevent div-by-zero
-
-    std::vector<size_t> kverts(K);  // K closest vertices on the target model.
-    std::vector<float> sqdis(K);    // Corresponding squared distances of each closest vertex to the search vertex
-    using Triplet = Eigen::Triplet<float>;
-    std::vector<Triplet> aelems( n*K, Triplet(0,0,0.0f));   // Elements for the affinity matrix
-    size_t c = 0;   // Counter for aelems
+    constexpr float EPS = 1e-6f; // Required in the case of any distance == 0 to prevent div-by-zero
 
-    // For each floating vertex, find the K nearest vertices on the target
-    for ( size_t i = 0; i < n; ++i)
+    // The squared distances are replaced in place by the affinities with each chunk of
+    // query rows writing only to its own rows.
+    dispatchK( K, [&]( auto fk)
     {
-        kdt.findn( _qry.row(i), K, &kverts[0], &sqdis[0]); // Find k nearest points on tgt for point i
+        constexpr size_t FK = decltype(fk)::value;
+        parallelFor( n, _nthreads, [&]( size_t b, size_t e)
+        {
+            for ( size_t i = b; i < e; ++i)
+            {
+                // It was found that incorporating how agreeable the orientation is does not significantly affect
+                // the outcome so this step is removed.
+                //const Vec3f n = _qry.row(i).tail<3>();    // Normal for query point i
 
-        // It was found that incorporating how agreeable the orientation is does not significantly affect
-        // the outcome so this step is removed.
-        //const Vec3f n = _qry.row(i).tail<3>();    // Normal for query point i
+                for ( size_t k = 0; k < numK<FK>(K); ++k)
+                {
+                    if ( kverts(i,k) < 0)   // No target vertex within the maximum distance
+                    {
+                        sqdis(i,k) = 0.0f;
+                        continue;
+                    }   // end if
+                    const float aij = powf( std::max( sqdis(i,k), EPS), -1); // Affinity weight as inverse squared distance
+                    // Incorporate the orientation from the matched target vertex (REMOVED)
+                    //aij *= 0.5f + n.dot( kdt.data().row(kverts(i,k)).tail<3>()) / 2.0f; // Normalise dot product in [0,1]
+                    // Check for numerical stability since normalizing these elements later.
+                    sqdis(i,k) = std::max( aij, 1e-4f);
+                }   // end for
+            }   // end for
+        }, 256);
+    });
 
-        for ( size_t k = 0; k < K; ++k)
-        {
-            const size_t j = kverts.at(k); // j is vertex row on target closest to vertex i of query set
-            const float aij = powf( std::max( sqdis[k], EPS), -1); // Affinity weight as inverse squared distance
-            // Incorporate the orientation from the matched target vertex (REMOVED)
-            //aij *= 0.5f + n.dot( kdt.data().row(j).tail<3>()) / 2.0f; // Normalise dot product in [0,1]
-            // Check for numerical stability since normalizing these elements later and set the entry.
-            aelems[c++] = Triplet(i, j, std::max( aij, 1e-4f));
-        }   // end for
-    }   // end for
-
-    SparseMat A( n, m);
-    A.setFromTriplets( aelems.begin(), aelems.end());
-    return A;
-}   // end find
+    return EllAffinity( std::move(kverts), std::move(sqdis), m);
+}   // end _affinities
@@ -17,25 +17,13 @@
 
 #include <KNNMap.h>
 using rNonRigid::KNNMap;
-using rNonRigid::MatX3f;
-using rNonRigid::K3Tree;
+using rNonRigid::MatX3fRef;
+using rNonRigid::K3Index;
 
 
-KNNMap::KNNMap( const MatX3f &qry, const K3Tree &kdt, size_t K)
-    : _idxs( qry.rows(), K), _sqds( qry.rows(), K)
+KNNMap::KNNMap( const MatX3fRef &qry, const K3Index &kdt, size_t K, size_t nthreads)
 {
-    const size_t N = qry.rows();
-    std::vector<size_t> idxs(K);
-    std::vector<float> sqds(K);
-    for ( size_t i = 0; i < N; ++i)
-    {
-        kdt.findn( qry.row(i), K, &idxs[0], &sqds[0]);
-        for ( size_t k = 0; k < K; ++k)
-        {
-            _idxs(i,k) = int(idxs[k]);
-            _sqds(i,k) = sqds[k];
-        }   // end for
-    }   // end for
+    kdt.findn( qry, K, _idxs, _sqds, nthreads);
 }   // end ctor
 
 
@@ -0,0 +1,70 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <MappedFile.h>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using rNonRigid::MappedFile;
+
+
+std::shared_ptr<MappedFile> MappedFile::open( const std::string &fname)
+{
+    std::shared_ptr<MappedFile> mf( new MappedFile);
+#ifdef _WIN32
+    std::ifstream ifs( fname, std::ios::binary | std::ios::ate);
+    if ( !ifs)
+        return nullptr;
+    mf->_buf.resize( size_t( ifs.tellg()));
+    ifs.seekg( 0);
+    if ( !ifs.read( mf->_buf.data(), mf->_buf.size()))
+        return nullptr;
+    mf->_data = mf->_buf.data();
+    mf->_size = mf->_buf.size();
+#else
+    const int fd = ::open( fname.c_str(), O_RDONLY);
+    if ( fd < 0)
+        return nullptr;
+    struct stat st;
+    if ( fstat( fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close( fd);
+        return nullptr;
+    }   // end if
+    void *addr = mmap( nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close( fd);   // The mapping remains valid after the descriptor is closed
+    if ( addr == MAP_FAILED)
+        return nullptr;
+    mf->_data = static_cast<const char*>( addr);
+    mf->_size = size_t(st.st_size);
+#endif
+    return mf;
+}   // end open
+
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if ( _data)
+        munmap( const_cast<char*>( _data), _size);
+#endif
+}   // end dtor
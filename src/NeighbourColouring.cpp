@@ -0,0 +1,117 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <NeighbourColouring.h>
+#include <algorithm>
+using rNonRigid::CompactWeights;
+using rNonRigid::NeighbourColouring;
+using rNonRigid::SmoothingWeights;
+using rNonRigid::StreamedWeights;
+
+
+NeighbourColouring::NeighbourColouring( const SmoothingWeights &swts)
+{
+    _colourRows( swts.indices().rows(), swts.indices().cols(), [&]( size_t i){ return swts.indices().row(i).data();});
+}   // end ctor
+
+
+NeighbourColouring::NeighbourColouring( const StreamedWeights &swts)
+{
+    std::shared_ptr<const StreamedWeights::Block> blk;
+    _colourRows( swts.rows(), swts.cols(), [&]( size_t i)
+    {
+        const size_t r = i % StreamedWeights::BLOCK_ROWS;
+        if ( r == 0)
+            blk = swts.block( i / StreamedWeights::BLOCK_ROWS);
+        return &blk->indices(r,0);
+    });
+}   // end ctor
+
+
+NeighbourColouring::NeighbourColouring( const CompactWeights &cwts)
+{
+    std::vector<int> nidxs( cwts.cols());
+    std::vector<float> wts( cwts.cols());
+    _colourRows( cwts.rows(), cwts.cols(), [&]( size_t i)
+    {
+        cwts.decode<0>( i, nidxs.data(), wts.data());
+        return nidxs.data();
+    });
+}   // end ctor
+
+
+NeighbourColouring::NeighbourColouring( const std::vector<int> &colours) : _colour( colours)
+{
+    int nc = 0;
+    for ( int c : _colour)
+        nc = std::max( nc, c+1);
+    _orderColours( nc);
+}   // end ctor
+
+
+void NeighbourColouring::_colourRows( size_t N, size_t K, const std::function<const int*(size_t)> &row)
+{
+    // Vertices are coloured in index order with the rows read once each. The colours of the
+    // vertices having vertex i as a neighbour that are coloured before it are passed forward
+    // to i as each is coloured, so only those of vertices yet to be coloured are held.
+    _colour.assign( N, -1);
+    std::vector<std::vector<int> > pending( N);
+    std::vector<int> taken; // Colours are marked as taken by the index of the vertex being coloured
+    int nc = 0;
+    for ( size_t i = 0; i < N; ++i)
+    {
+        const int *nidxs = row(i);
+        for ( size_t k = 0; k < K; ++k)
+            if ( _colour[nidxs[k]] >= 0)
+                taken[_colour[nidxs[k]]] = int(i);
+        for ( int c : pending[i])
+            taken[c] = int(i);
+        std::vector<int>().swap( pending[i]);
+
+        int c = 0;
+        while ( c < nc && taken[c] == int(i))
+            c++;
+        if ( c == nc)
+        {
+            taken.push_back( -1);
+            nc++;
+        }   // end if
+        _colour[i] = c;
+
+        for ( size_t k = 0; k < K; ++k)
+            if ( nidxs[k] > int(i))
+                pending[nidxs[k]].push_back( c);
+    }   // end for
+
+    _orderColours( nc);
+}   // end _colourRows
+
+
+void NeighbourColouring::_orderColours( int nc)
+{
+    // Order the vertices by colour with a counting sort.
+    const size_t N = _colour.size();
+    _colourStart.assign( nc+1, 0);
+    for ( size_t i = 0; i < N; ++i)
+        _colourStart[_colour[i]+1]++;
+    for ( int c = 0; c < nc; ++c)
+        _colourStart[c+1] += _colourStart[c];
+    _order.resize( N);
+    std::vector<int> next( _colourStart.begin(), _colourStart.end() - 1);
+    for ( size_t i = 0; i < N; ++i)
+        _order[next[_colour[i]]++] = int(i);
+}   // end _orderColours
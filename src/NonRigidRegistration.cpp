@@ -17,10 +17,31 @@
 
 #include <NonRigidRegistration.h>
 #include <ViscoElasticTransformer.h>
-#include <SmoothingWeights.h>
-#include <memory>
+#include <SmoothingHierarchy.h>
+#include <RegionOfInterest.h>
+#include <cassert>
 using rNonRigid::NonRigidRegistration;
 using rNonRigid::Mesh;
+using rNonRigid::SmoothingHierarchy;
+using rNonRigid::CompactWeights;
+using rNonRigid::StreamedWeights;
+using rNonRigid::TemplatePackage;
+using rNonRigid::RegistrationWorkspace;
+using rNonRigid::VertexOrder;
+
+
+namespace {
+
+// Restores the caller's vertex order however the registration is left.
+struct RestoreOrder
+{
+    RestoreOrder( const VertexOrder *v, Mesh &m) : vorder(v), mesh(m) {}
+    ~RestoreOrder() { if ( vorder) vorder->restore( mesh);}
+    const VertexOrder *vorder;
+    Mesh &mesh;
+};  // end struct
+
+}   // end namespace
 
 
 NonRigidRegistration::NonRigidRegistration( size_t numUpdateIts,
@@ -28,45 +49,138 @@ NonRigidRegistration::NonRigidRegistration( size_t numUpdateIts,
                                             float kappa, bool useOrient, size_t numInlierIts,
                                             size_t smoothK, float smoothS,
                                             size_t nvStart, size_t nvEnd,
-                                            size_t neStart, size_t neEnd)
+                                            size_t neStart, size_t neEnd,
+                                            const Options &opts)
     :
       _numUpdateIts( numUpdateIts),
       _smoothK( smoothK), _smoothS( smoothS),
-      _corresponder( k, flagThresh, eqPushPull),
+      _corresponder( k, flagThresh, eqPushPull, opts.numThreads, opts.maxCorrDist),
       _inlierFinder( kappa, useOrient, numInlierIts),
       _nvStart(nvStart), _nvEnd(nvEnd),
-      _neStart(neStart), _neEnd(neEnd)
+      _neStart(neStart), _neEnd(neEnd),
+      _nthreads(opts.numThreads), _fltIndex(opts.floatingIndex), _cropPad(opts.cropPadding),
+      _smoothTol(opts.smoothTol), _smoothLevels(opts.smoothLevels), _compactWeights(opts.compactWeights),
+      _smoothBudget(opts.smoothBudget), _reorder(opts.reorderVertices)
 {
 }   // end ctor
 
 
-void NonRigidRegistration::operator()( Mesh &flt, const Mesh &tgt) const
+bool NonRigidRegistration::operator()( Mesh &flt, const Mesh &tgt, RegistrationWorkspace *workspace,
+                                       const TemplatePackage *pkg, const std::shared_ptr<K3Index> &tindex) const
+{
+    if ( pkg && !pkg->matches( flt.positionsView(), _smoothK, _smoothS))
+        pkg = nullptr;
+    RegistrationWorkspace ownWorkspace;
+    _register( flt, tgt, tindex, pkg, workspace ? *workspace : ownWorkspace);
+    return pkg != nullptr;
+}   // end operator()
+
+
+void NonRigidRegistration::_register( Mesh &flt, const Mesh &tgt, const std::shared_ptr<K3Index> &tindex,
+                                      const TemplatePackage *pkg, RegistrationWorkspace &ws) const
 {
-    // The KD-tree for the floating surface is rebuilt every iteration...
-    std::shared_ptr<K3Tree> kdF = std::shared_ptr<K3Tree>( new K3Tree( flt.positions()));
-    const K3Tree kdT( tgt.positions());  // ...while the target is unchanging.
+    assert( !tindex || tindex->numPoints() == size_t(tgt.features.rows()));
+
+    // Put the floating vertices in Morton order (as held by the package if given) until done.
+    std::unique_ptr<VertexOrder> ownOrder;
+    if ( !pkg && _reorder)
+        ownOrder.reset( new VertexOrder( flt.positionsView()));
+    const VertexOrder *vorder = pkg ? pkg->vertexOrder() : ownOrder.get();
+    if ( vorder)
+        vorder->apply( flt);
+    const RestoreOrder restoreOrder( vorder, flt);
+
+    // The index for the floating surface references the positions in flt's features which are
+    // updated in place and is refit every iteration (a package's index copies them on refit and
+    // is refit straight away if the template has moved rigidly since the package was saved)...
+    const std::shared_ptr<K3Index> kdF = pkg ? pkg->newIndex() : createIndex( flt.positionsView(), _fltIndex, _nthreads);
+    if ( pkg && kdF->data() != flt.positionsView())
+        kdF->refit( flt.positionsView());
+    // ...while the target only changes if cropped to a new region.
+    RegionOfInterest roi( tgt.features, _cropPad, _corresponder.k() + 1);
+    roi.update( flt.positionsView());
+    const auto targetIndex = [&]()
+    {
+        return tindex && !roi.isCropped() ? tindex : createIndex( roi.positions(), IndexType::AUTO, _nthreads);
+    };  // end targetIndex
+    std::shared_ptr<K3Index> kdT = targetIndex();
 
     // Only need to define the smoothing weights once for the floating surface since each vertex
     // weight is calculated only from the distribution of locally neighbouring points and this
     // isn't based on distance (which is updated with each iteration).
-    const SmoothingWeights smw( *kdF, _smoothK, _smoothS);
-
-    ViscoElasticTransformer vetrans( smw, _nvStart, _nvEnd, _neStart, _neEnd, _numUpdateIts);
+    // With a budget, the weights are instead computed a block at a time on demand. With threads,
+    // the colouring of their neighbours for the outlier diffusion is made with them. A package
+    // provides both already computed for the template.
+    std::unique_ptr<SmoothingWeights> smw;
+    std::unique_ptr<StreamedWeights> stw;
+    std::unique_ptr<SmoothingHierarchy> smh;
+    std::unique_ptr<CompactWeights> cmw;
+    std::unique_ptr<NeighbourColouring> nbc;    // Colouring for the outlier diffusion made with the weights
+    std::unique_ptr<ViscoElasticTransformer> vetrans;
+    if ( _smoothBudget > 0 && !pkg)
+    {
+        stw.reset( new StreamedWeights( flt.positionsView(), _smoothK, _smoothS, _smoothBudget,
+                                        _fltIndex, _nthreads, true));
+        if ( _nthreads > 1)
+            nbc.reset( new NeighbourColouring( *stw));
+        vetrans.reset( new ViscoElasticTransformer( *stw, _nvStart, _nvEnd, _neStart, _neEnd, _numUpdateIts, 0.8f, 15,
+                                                    _nthreads, nbc.get(), &ws.vet));
+    }   // end if
+    else
+    {
+        if ( !pkg)
+        {
+            smw.reset( new SmoothingWeights( *kdF, _smoothK, _smoothS, _nthreads));
+            if ( _nthreads > 1)
+                nbc.reset( new NeighbourColouring( *smw));
+        }   // end if
+        const SmoothingWeights &swts = pkg ? pkg->weights() : *smw;
+        const SmoothingHierarchy *hierarchy = pkg ? pkg->hierarchy( _smoothLevels) : nullptr;
+        if ( _smoothLevels > 1 && !hierarchy)
+        {
+            smh.reset( new SmoothingHierarchy( swts, flt.positionsView(), _smoothLevels));
+            hierarchy = smh.get();
+        }   // end if
+        const NeighbourColouring *colouring = pkg ? &pkg->colouring() : nbc.get();
+        if ( _compactWeights)
+        {
+            // Everything after is read from the compact copy so the weights made here are freed.
+            cmw.reset( new CompactWeights( swts));
+            smw.reset();
+            vetrans.reset( new ViscoElasticTransformer( *cmw, _nvStart, _nvEnd, _neStart, _neEnd, _numUpdateIts, 0.8f, 15,
+                                                        _nthreads, _smoothTol, hierarchy, colouring, &ws.vet));
+        }   // end if
+        else
+            vetrans.reset( new ViscoElasticTransformer( swts, _nvStart, _nvEnd, _neStart, _neEnd, _numUpdateIts, 0.8f, 15,
+                                                        _nthreads, _smoothTol, hierarchy, colouring, &ws.vet));
+    }   // end else
 
-    VecXf flags;  // Correspondence flags updated every iteration by the symmetric corresponder
+    // Each iteration's searches start from the last one's neighbours (but not from those of the
+    // last registration to use the workspace). Every iteration's results are held in the workspace.
+    ws.nbrs.stale = true;
     for ( size_t i = 0; i < _numUpdateIts; ++i)
     {
-        const SparseMat A = _corresponder( *kdF, kdT, flags);   // F.rows() X T.rows()
-        assert( flags.size() == flt.features.rows());
-        const MatX6f crs = A * tgt.features;   // F rows
-        const VecXf wts = _inlierFinder( flt.features, crs, flags); // Correspondence weights
+        // Correspondences on the (cropped) target for each row of F. Points without correspondences
+        // are kept where they are so have no displacement. After the first iteration, the floating
+        // index is refit to the updated positions alongside the search from them to the target.
+        // Displacements per iteration are small so a tree's structure remains valid and only its
+        // bounds need updating (it rebuilds itself if they degrade too far).
+        if ( i == 0)
+            _corresponder.features( *kdF, *kdT, flt.features, roi.features(), ws.flags, ws.nbrs, ws.crs);
+        else
+            _corresponder.refitFeatures( *kdF, *kdT, flt.features, roi.features(), ws.flags, ws.nbrs, ws.crs);
+        assert( ws.flags.size() == flt.features.rows());
+        _inlierFinder( flt.features, ws.crs, ws.flags, ws.wts, ws.sqDists); // Correspondence weights
 
         // Displacement field from current mask points to corresponding points on tgt
-        MatX3f df = crs.leftCols<3>() - flt.positions();
-        vetrans.update( df, wts); // Regularise, add, then relax back total deformation field.
-        flt.update( df);    // Update
+        ws.df = ws.crs.leftCols<3>() - flt.positionsView();
+        vetrans->update( ws.df, ws.wts); // Regularise, add, then relax back total deformation field.
+        flt.update( ws.df, _nthreads);    // Update
 
-        if ( i < _numUpdateIts - 1)
-            kdF = std::shared_ptr<K3Tree>( new K3Tree( flt.positions()));
+        if ( i < _numUpdateIts - 1 && roi.update( flt.positionsView()))
+        {
+            kdT = targetIndex();
+            ws.nbrs.stale = true;   // Target rows have changed
+        }   // end if
     }   // end for
-}   // end operator()
+}   // end _register
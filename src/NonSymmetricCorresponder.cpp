@@ -18,16 +18,16 @@
 #include <NonSymmetricCorresponder.h>
 using rNonRigid::NonSymmetricCorresponder;
 using rNonRigid::SparseMat;
-using rNonRigid::K3Tree;
+using rNonRigid::K3Index;
 
 
-NonSymmetricCorresponder::NonSymmetricCorresponder( size_t k) : _k(k) {}
+NonSymmetricCorresponder::NonSymmetricCorresponder( size_t k, size_t nthreads) : _k(k), _nthreads(nthreads) {}
 
 
-SparseMat NonSymmetricCorresponder::operator()( const MatX3f &F, const K3Tree& T) const
+SparseMat NonSymmetricCorresponder::operator()( const MatX3f &F, const K3Index& T) const
 {
     // knnF2T will iterate over floating and search for correspondences on target
-    KNNCorresponder knnF2T( F, _k);
+    KNNCorresponder knnF2T( viewOf(F), _k, _nthreads);
     return normaliseRows( knnF2T.find( T));
 }   // end operator()
 
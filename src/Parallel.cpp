@@ -0,0 +1,163 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <Parallel.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+// A single call to parallelFor. Chunks are claimed from the atomic counter by whichever
+// threads pick up the job, including the calling thread, so the caller never waits on
+// work that no other thread has started.
+struct Job
+{
+    Job( const std::function<void(size_t, size_t)> &f, size_t n, size_t csz)
+        : fn(f), num(n), chunkSize(csz), numChunks((n + csz - 1) / csz), next(0), done(0) {}
+
+    // Process chunks until there are none left to claim.
+    void work()
+    {
+        size_t c;
+        while ( (c = next++) < numChunks)
+        {
+            const size_t b = c * chunkSize;
+            fn( b, std::min( b + chunkSize, num));
+            if ( ++done == numChunks)
+            {
+                std::lock_guard<std::mutex> lock( mtx);
+                cv.notify_all();
+            }   // end if
+        }   // end while
+    }   // end work
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock( mtx);
+        cv.wait( lock, [this](){ return done == numChunks;});
+    }   // end wait
+
+    const std::function<void(size_t, size_t)> &fn;
+    const size_t num;
+    const size_t chunkSize;
+    const size_t numChunks;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::mutex mtx;
+    std::condition_variable cv;
+};  // end struct
+
+
+class Pool
+{
+public:
+    static Pool& get()
+    {
+        static Pool pool;
+        return pool;
+    }   // end get
+
+    // Make at least n worker threads available and queue the job for up to n of them.
+    void submit( const std::shared_ptr<Job> &job, size_t n)
+    {
+        std::lock_guard<std::mutex> lock( _mtx);
+        while ( _workers.size() < n)
+            _workers.emplace_back( [this](){ _run();});
+        for ( size_t i = 0; i < n; ++i)
+            _jobs.push_back( job);
+        _cv.notify_all();
+    }   // end submit
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _mtx);
+            _stop = true;
+        }
+        _cv.notify_all();
+        for ( std::thread &t : _workers)
+            t.join();
+    }   // end dtor
+
+private:
+    Pool() : _stop(false) {}
+
+    void _run()
+    {
+        while ( true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock( _mtx);
+                _cv.wait( lock, [this](){ return _stop || !_jobs.empty();});
+                if ( _stop)
+                    return;
+                job = _jobs.front();
+                _jobs.pop_front();
+            }
+            job->work();
+        }   // end while
+    }   // end _run
+
+    std::vector<std::thread> _workers;
+    std::deque<std::shared_ptr<Job> > _jobs;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    bool _stop;
+};  // end class
+
+}   // end namespace
+
+
+void rNonRigid::parallelFor( size_t n, size_t nthreads,
+                             const std::function<void(size_t, size_t)> &fn, size_t minChunk)
+{
+    if ( n == 0)
+        return;
+
+    minChunk = std::max<size_t>( minChunk, 1);
+    nthreads = std::min( nthreads, (n + minChunk - 1) / minChunk);
+    if ( nthreads <= 1)
+    {
+        fn( 0, n);
+        return;
+    }   // end if
+
+    // Use a few chunks per thread so that uneven chunk costs are balanced out.
+    const size_t chunkSize = std::max( minChunk, (n + 4*nthreads - 1) / (4*nthreads));
+    std::shared_ptr<Job> job = std::make_shared<Job>( fn, n, chunkSize);
+    Pool::get().submit( job, std::min( nthreads, job->numChunks) - 1);
+    job->work();
+    job->wait();
+}   // end parallelFor
+
+
+void rNonRigid::parallelInvoke( const std::function<void()> &a, const std::function<void()> &b, size_t nthreads)
+{
+    parallelFor( 2, nthreads, [&]( size_t i, size_t e)
+    {
+        for ( ; i < e; ++i)
+            (i == 0 ? a : b)();
+    }, 1);
+}   // end parallelInvoke
@@ -0,0 +1,85 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <RegionOfInterest.h>
+#include <cassert>
+using rNonRigid::RegionOfInterest;
+using rNonRigid::MatX3fRef;
+using rNonRigid::Vec3f;
+
+
+RegionOfInterest::RegionOfInterest( const MatXf &tgt, float padding, size_t minRows)
+    : _full(tgt), _padding(padding), _minRows(minRows), _cropped(false), _hasBox(false)
+{
+    assert( tgt.cols() >= 3);
+}   // end ctor
+
+
+bool RegionOfInterest::update( const MatX3fRef &flt)
+{
+    if ( _padding <= 0.0f || flt.rows() == 0)
+        return false;
+
+    const Vec3f flo = flt.colwise().minCoeff();
+    const Vec3f fhi = flt.colwise().maxCoeff();
+    const float pad = _padding * (fhi - flo).norm();
+
+    // Keep the current crop while the floating points are at least half the padding inside it
+    // and it's no more than the padding larger along each axis than the ideal crop would be.
+    if ( _hasBox)
+    {
+        const Vec3f hpad = Vec3f::Constant( 0.5f * pad);
+        const bool inside = ((flo - hpad).array() >= _lo.array()).all()
+                         && ((fhi + hpad).array() <= _hi.array()).all();
+        const bool tight = ((_hi - _lo).array() <= (fhi - flo).array() + 3.0f * pad).all();
+        if ( inside && tight)
+            return false;
+    }   // end if
+
+    _lo = flo - Vec3f::Constant( pad);
+    _hi = fhi + Vec3f::Constant( pad);
+    _hasBox = true;
+
+    std::vector<int> idxs;
+    const int N = int(_full.rows());
+    for ( int i = 0; i < N; ++i)
+    {
+        const Vec3f p = _full.row(i).head<3>();
+        if ( (p.array() >= _lo.array()).all() && (p.array() <= _hi.array()).all())
+            idxs.push_back(i);
+    }   // end for
+
+    // Use the whole target if cropping would leave too little of it (or doesn't remove anything).
+    if ( idxs.size() < _minRows || idxs.size() == size_t(N))
+    {
+        const bool changed = _cropped;
+        _cropped = false;
+        _idxs.clear();
+        _crop.resize( 0, 0);
+        return changed;
+    }   // end if
+
+    if ( _cropped && idxs == _idxs)
+        return false;
+
+    _cropped = true;
+    _idxs.swap( idxs);
+    _crop.resize( _idxs.size(), _full.cols());
+    for ( size_t i = 0; i < _idxs.size(); ++i)
+        _crop.row(i) = _full.row(_idxs[i]);
+    return true;
+}   // end update
@@ -17,6 +17,8 @@
 
 #include <RigidRegistration.h>
 #include <RigidTransformer.h>
+#include <RegionOfInterest.h>
+#include <cassert>
 using rNonRigid::RigidRegistration;
 using rNonRigid::Mat4f;
 using rNonRigid::Mesh;
@@ -24,32 +26,55 @@ using rNonRigid::Mesh;
 RigidRegistration::RigidRegistration( size_t maxUpdateIts,
                                       size_t k, float flagThresh, bool eqPushPull,
                                       float kappa, bool useOrient, size_t numInlierIts,
-                                      bool useScaling)
+                                      bool useScaling, size_t nthreads, IndexType fltIndex,
+                                      float maxDist, float cropPad)
     :
       _maxUpdateIts( maxUpdateIts),
-      _corresponder( k, flagThresh, eqPushPull),
+      _corresponder( k, flagThresh, eqPushPull, nthreads, maxDist),
       _inlierFinder( kappa, useOrient, numInlierIts),
-      _useScaling( useScaling)
+      _useScaling( useScaling),
+      _nthreads( nthreads),
+      _fltIndex( fltIndex),
+      _cropPad( cropPad)
 {
 }   // end ctor
 
 
 Mat4f RigidRegistration::operator()( Mesh &flt, const Mesh &tgt, Mat4f nT) const
 {
-    const K3Tree kdT( tgt.positions());
+    return operator()( flt, tgt, nullptr, nT);
+}   // end operator()
+
+
+Mat4f RigidRegistration::operator()( Mesh &flt, const Mesh &tgt, const std::shared_ptr<K3Index> &tindex, Mat4f nT) const
+{
+    assert( !tindex || tindex->numPoints() == size_t(tgt.features.rows()));
+
+    // The target index is only recreated when the target is cropped to a new region
+    RegionOfInterest roi( tgt.features, _cropPad, _corresponder.k() + 1);
+    std::shared_ptr<K3Index> kdT;
+    // Refit to the transformed floating positions every iteration
+    const std::shared_ptr<K3Index> kdF = createIndex( flt.positionsView(), _fltIndex, _nthreads);
     const RigidTransformer rgdTrans( _useScaling);
 
     Mat4f T = Mat4f::Identity();
     VecXf flags;  // Correspondence flags
+    MatXf crs;    // Correspondences
+    SymmetricCorresponder::WarmStart nbrs;  // Neighbours from the last iteration to start searches from
     for ( size_t i = 0; i < _maxUpdateIts; ++i)
     {
         T = nT * T;
         flt.transform( nT);
-        const K3Tree kdF( flt.positions());
-        const SparseMat A = _corresponder( kdF, kdT, flags); // F.rows() X T.rows()
-        const MatXf crs = A * tgt.features;    // F rows
+        if ( roi.update( flt.positionsView()) || !kdT)
+        {
+            kdT = tindex && !roi.isCropped() ? tindex : createIndex( roi.positions(), IndexType::AUTO, _nthreads);
+            nbrs = SymmetricCorresponder::WarmStart();
+        }   // end if
+        // Correspondences on the (cropped) target for each row of F with the floating index
+        // refit to the transformed positions alongside the search from them to the target.
+        _corresponder.refitFeatures( *kdF, *kdT, flt.features, roi.features(), flags, nbrs, crs);
         const VecXf wts = _inlierFinder( flt.features, crs, flags); // Correspondence weights
-        nT = rgdTrans( flt.positions(), crs.leftCols<3>(), wts);  // Calc next transform
+        nT = rgdTrans( flt.positionsView(), crs.leftCols<3>(), wts);  // Calc next transform
         if ( nT.isIdentity( 1e-4f)) // Done if close to not needing another transform
             break;
     }   // end for
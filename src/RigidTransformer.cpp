@@ -25,12 +25,14 @@ using rNonRigid::VecXf;
 using rNonRigid::Mat3f;
 using rNonRigid::Mat4f;
 using rNonRigid::MatXf;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
 
 namespace {
 
 // Returns cross variance matrix (vertices stored per row for fps/cps)
-Mat3f computeCV( const MatXf& fps, const Vec3f& fwm,
-                 const MatXf& cps, const Vec3f& cwm,
+Mat3f computeCV( const MatX3fRef& fps, const Vec3f& fwm,
+                 const MatX3fRef& cps, const Vec3f& cwm,
                  const VecXf& wts, float wsum)
 {
     const MatXf wfps = fps.array().colwise() * wts.array();
@@ -92,8 +94,8 @@ Mat3f computeRotationMatrix( const Mat4f& Q)
 
 
 // For vectors stored as rows in fps/cps
-float estimateScaleFactor( const MatXf& fps, const Vec3f& fwm,
-                           const MatXf& cps, const Vec3f& cwm,
+float estimateScaleFactor( const MatX3fRef& fps, const Vec3f& fwm,
+                           const MatX3fRef& cps, const Vec3f& cwm,
                            const VecXf& wts, const Mat3f& R)
 {
     const MatXf cfp = (fps.rowwise() - fwm.transpose()) * R.transpose(); // Centre and rotate and weight the floating positions
@@ -109,7 +111,7 @@ float estimateScaleFactor( const MatXf& fps, const Vec3f& fwm,
 RigidTransformer::RigidTransformer( bool us) : _useScaling(us) {}
 
 
-Mat4f RigidTransformer::operator()( const MatX3f &flt, const MatX3f &crs, const VecXf &wts) const
+Mat4f RigidTransformer::operator()( const MatX3fRef &flt, const MatX3fRef &crs, const VecXf &wts) const
 {
     assert( flt.rows() == crs.rows());
     assert( flt.rows() == wts.size());
@@ -0,0 +1,195 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <SmoothingHierarchy.h>
+#include <algorithm>
+#include <cassert>
+#include <utility>
+using rNonRigid::SmoothingHierarchy;
+using rNonRigid::RowMatXf;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatX3f;
+
+
+namespace {
+
+// Coarsening stops once a level would have more than 1/MIN_COARSENING of the vertices below it.
+static const double MIN_COARSENING = 1.5;
+
+// Set cluster to the cluster of each vertex of a level given its operator as compressed rows
+// (the values ordering each vertex's neighbours by strength) and return the number of clusters.
+// Vertices all of whose m strongest neighbours are free start a cluster with them. Vertices
+// left over then join the cluster of their strongest clustered neighbour (or start their own).
+int aggregate( const std::vector<int> &rowStart, const std::vector<int> &cols, const std::vector<float> &vals,
+               size_t m, std::vector<int> &cluster)
+{
+    const size_t n = rowStart.size() - 1;
+    std::vector<int> strong( n*m, -1);  // The m strongest neighbours of each vertex (excluding itself)
+    std::vector<std::pair<float,int> > nbs;
+    for ( size_t i = 0; i < n; ++i)
+    {
+        nbs.clear();
+        for ( int e = rowStart[i]; e < rowStart[i+1]; ++e)
+            if ( cols[e] != int(i))
+                nbs.push_back( std::make_pair( -vals[e], cols[e]));
+        const size_t nm = std::min( m, nbs.size());
+        std::partial_sort( nbs.begin(), nbs.begin() + nm, nbs.end());
+        for ( size_t k = 0; k < nm; ++k)
+            strong[i*m + k] = nbs[k].second;
+    }   // end for
+
+    int nc = 0;
+    cluster.assign( n, -1);
+    for ( size_t i = 0; i < n; ++i)
+    {
+        if ( cluster[i] >= 0)
+            continue;
+        const int *s = &strong[i*m];
+        bool free = true;
+        for ( size_t k = 0; k < m && s[k] >= 0 && free; ++k)
+            free = cluster[s[k]] < 0;
+        if ( !free)
+            continue;
+        cluster[i] = nc;
+        for ( size_t k = 0; k < m && s[k] >= 0; ++k)
+            cluster[s[k]] = nc;
+        nc++;
+    }   // end for
+
+    for ( size_t i = 0; i < n; ++i)
+    {
+        if ( cluster[i] >= 0)
+            continue;
+        const int *s = &strong[i*m];
+        for ( size_t k = 0; k < m && s[k] >= 0 && cluster[i] < 0; ++k)
+            cluster[i] = cluster[s[k]];
+        if ( cluster[i] < 0)
+            cluster[i] = nc++;
+    }   // end for
+
+    return nc;
+}   // end aggregate
+
+}   // end namespace
+
+
+SmoothingHierarchy::SmoothingHierarchy( const SmoothingWeights &swts, const MatX3fRef &pos, size_t maxLevels, size_t m)
+    : _n0( swts.indices().rows()), _width( std::max<size_t>( swts.indices().cols(), 1) - 1), _pos0( pos)
+{
+    assert( m > 0);
+    assert( size_t(pos.rows()) == _n0);
+
+    // The template's operator averages the first K-1 neighbours of each vertex (see ViscoElasticTransformer).
+    std::vector<int> rowStart( _n0 + 1), cols( _n0 * _width);
+    std::vector<float> vals( _n0 * _width);
+    for ( size_t i = 0; i < _n0; ++i)
+    {
+        rowStart[i] = int(i*_width);
+        for ( size_t k = 0; k < _width; ++k)
+        {
+            cols[i*_width + k] = swts.indices()(i,k);
+            vals[i*_width + k] = swts.weights()(i,k);
+        }   // end for
+    }   // end for
+    rowStart[_n0] = int(_n0*_width);
+
+    while ( _levels.size() + 1 < maxLevels)
+    {
+        const size_t nf = rowStart.size() - 1;
+        Level lvl;
+        const int nc = aggregate( rowStart, cols, vals, m, lvl.cluster);
+        if ( nc <= 1 || double(nc) * MIN_COARSENING > double(nf))
+            break;
+
+        lvl.invSize.assign( nc, 0.0f);
+        for ( size_t i = 0; i < nf; ++i)
+            lvl.invSize[lvl.cluster[i]] += 1.0f;
+        std::vector<int> memStart( nc + 1, 0);
+        for ( int c = 0; c < nc; ++c)
+        {
+            memStart[c+1] = memStart[c] + int(lvl.invSize[c]);
+            lvl.invSize[c] = 1.0f / lvl.invSize[c];
+        }   // end for
+        std::vector<int> members( nf), next( memStart.begin(), memStart.end() - 1);
+        for ( size_t i = 0; i < nf; ++i)
+            members[next[lvl.cluster[i]]++] = int(i);
+
+        // Each cluster's row holds the distinct clusters of its members' neighbours.
+        std::vector<int> marker( nc, -1), pos( nc);
+        lvl.rowStart.resize( nc + 1);
+        lvl.slot.resize( cols.size());
+        for ( int c = 0; c < nc; ++c)
+        {
+            lvl.rowStart[c] = int(lvl.cols.size());
+            for ( int mi = memStart[c]; mi < memStart[c+1]; ++mi)
+            {
+                const int i = members[mi];
+                for ( int e = rowStart[i]; e < rowStart[i+1]; ++e)
+                {
+                    const int c2 = lvl.cluster[cols[e]];
+                    if ( marker[c2] != c)
+                    {
+                        marker[c2] = c;
+                        pos[c2] = int(lvl.cols.size());
+                        lvl.cols.push_back( c2);
+                    }   // end if
+                    lvl.slot[e] = pos[c2];
+                }   // end for
+            }   // end for
+        }   // end for
+        lvl.rowStart[nc] = int(lvl.cols.size());
+
+        const MatX3f &fpos = positions( _levels.size());
+        lvl.centroid = MatX3f::Zero( nc, 3);
+        for ( size_t i = 0; i < nf; ++i)
+            lvl.centroid.row( lvl.cluster[i]) += lvl.invSize[lvl.cluster[i]] * fpos.row(i);
+
+        _levels.push_back( std::move( lvl));
+        std::vector<float> cvals;
+        _scatter( _levels.size(), vals.data(), cvals);
+        rowStart = _levels.back().rowStart;
+        cols = _levels.back().cols;
+        vals.swap( cvals);
+    }   // end while
+}   // end ctor
+
+
+void SmoothingHierarchy::_scatter( size_t l, const float *fine, std::vector<float> &coarse) const
+{
+    const Level &lvl = _levels[l-1];
+    coarse.assign( lvl.cols.size(), 0.0f);
+    const size_t nf = size( l-1);
+    for ( size_t i = 0; i < nf; ++i)
+    {
+        const float s = lvl.invSize[lvl.cluster[i]];
+        const int b = l == 1 ? int(i*_width) : _levels[l-2].rowStart[i];
+        const int e = l == 1 ? int((i+1)*_width) : _levels[l-2].rowStart[i+1];
+        for ( int j = b; j < e; ++j)
+            coarse[lvl.slot[j]] += fine[j] * s;
+    }   // end for
+}   // end _scatter
+
+
+std::vector<std::vector<float> > SmoothingHierarchy::coarseOperators( const RowMatXf &A) const
+{
+    assert( size_t(A.rows()) == _n0);
+    assert( size_t(A.cols()) == _width);
+    std::vector<std::vector<float> > ops( _levels.size());
+    for ( size_t l = 1; l <= _levels.size(); ++l)
+        _scatter( l, l == 1 ? A.data() : ops[l-2].data(), ops[l-1]);
+    return ops;
+}   // end coarseOperators
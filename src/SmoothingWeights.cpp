@@ -17,36 +17,55 @@
 
 #include <SmoothingWeights.h>
 #include <KNNMap.h>
+#include <cassert>
 #include <cfloat>
 #include <cmath>
+#include <new>
 using rNonRigid::SmoothingWeights;
-using rNonRigid::K3Tree;
+using rNonRigid::K3Index;
 
 
-SmoothingWeights::SmoothingWeights( const K3Tree &kdt, size_t K, float sigma)
+SmoothingWeights::SmoothingWeights( const K3Index &kdt, size_t K, float sigma, size_t nthreads)
+    : _iview( nullptr, 0, 0), _wview( nullptr, 0, 0)
 {
     const size_t N = kdt.data().rows();
-    const KNNMap kmap( kdt.data(), kdt, K);
+    const KNNMap kmap( kdt.data(), kdt, K, nthreads);
     _indices = kmap.indices();
-    _smw = MatXf( N,K);
+    _smw = RowMatXf( N,K);
 
+    const MatXf &sqds = kmap.sqDiffs();
+    for ( size_t i = 0; i < N; ++i)
+        calcWeights( &sqds(i,0), size_t(sqds.outerStride()), K, sigma, &_smw(i,0));
+
+    new (&_iview) RowMatXiView( _indices.data(), N, K);
+    new (&_wview) RowMatXfView( _smw.data(), N, K);
+}   // end ctor
+
+
+SmoothingWeights::SmoothingWeights( const RowMatXiView &idxs, const RowMatXfView &wts, const std::shared_ptr<const void> &owner)
+    : _iview( idxs), _wview( wts), _owner( owner)
+{
+    assert( idxs.rows() == wts.rows() && idxs.cols() == wts.cols());
+}   // end ctor
+
+
+void SmoothingWeights::calcWeights( const float *sqdis, size_t stride, size_t K, float sigma, float *wts)
+{
     static const float EPS = FLT_MIN;
     static const float ONE_MINUS_EPS = 1.0f - EPS;
     const float EXP_FACTOR = -0.5f / std::pow( sigma, 2.0f);
 
-    for ( size_t i = 0; i < N; ++i)
+    float wsum = 0.0f;
+    for ( size_t k = 0; k < K; ++k)
     {
-        float wsum = 0.0f;
-        for ( size_t k = 0; k < K; ++k)
-        {
-            const float dsq = kmap.sqDiffs()(i,k);      // Squared distance
-            const float gwt = std::exp( dsq * EXP_FACTOR);  // Gaussian weight
-            // Rescale weight in [EPS,1] instead of [0,1] so that nodes with an inlier weight
-            // of 0 don't end up with a deformation vector having zero magnitude.
-            const float wt = ONE_MINUS_EPS * gwt + EPS;
-            _smw(i,k) = wt;
-            wsum += wt;
-        }   // end for
-        _smw.row(i) /= wsum;  // Normalise the row of weights
+        const float dsq = sqdis[k*stride];              // Squared distance
+        const float gwt = std::exp( dsq * EXP_FACTOR);  // Gaussian weight
+        // Rescale weight in [EPS,1] instead of [0,1] so that nodes with an inlier weight
+        // of 0 don't end up with a deformation vector having zero magnitude.
+        const float wt = ONE_MINUS_EPS * gwt + EPS;
+        wts[k] = wt;
+        wsum += wt;
     }   // end for
-}   // end ctor
+    for ( size_t k = 0; k < K; ++k)
+        wts[k] /= wsum;  // Normalise the row of weights
+}   // end calcWeights
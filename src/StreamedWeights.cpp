@@ -0,0 +1,172 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64    // 64 bit off_t for pread/pwrite on 32 bit platforms
+#endif
+#include <StreamedWeights.h>
+#include <algorithm>
+#include <cstdint>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+using rNonRigid::StreamedWeights;
+using rNonRigid::MatX3fRef;
+using rNonRigid::IndexType;
+
+
+namespace {
+
+// States of a block in the page file
+enum : char { NOT_PAGED, WRITING, PAGED};
+
+// Read or write n bytes at a byte offset of the file (which may be past 2GB) without using or
+// moving the stream's position, so different blocks are read and written concurrently without
+// a lock. Only these are used on the file so its stream buffer is never involved.
+bool readAt( std::FILE *f, size_t offset, void *buf, size_t n)
+{
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.Offset = DWORD( uint64_t(offset));
+    ov.OffsetHigh = DWORD( uint64_t(offset) >> 32);
+    DWORD got = 0;
+    return ReadFile( HANDLE( _get_osfhandle( _fileno(f))), buf, DWORD(n), &got, &ov) && got == n;
+#else
+    char *p = static_cast<char*>( buf);
+    while ( n > 0)
+    {
+        const ssize_t got = pread( fileno(f), p, n, off_t(offset));
+        if ( got <= 0)
+            return false;
+        p += got;
+        offset += size_t(got);
+        n -= size_t(got);
+    }   // end while
+    return true;
+#endif
+}   // end readAt
+
+
+bool writeAt( std::FILE *f, size_t offset, const void *buf, size_t n)
+{
+#ifdef _WIN32
+    OVERLAPPED ov = {};
+    ov.Offset = DWORD( uint64_t(offset));
+    ov.OffsetHigh = DWORD( uint64_t(offset) >> 32);
+    DWORD put = 0;
+    return WriteFile( HANDLE( _get_osfhandle( _fileno(f))), buf, DWORD(n), &put, &ov) && put == n;
+#else
+    const char *p = static_cast<const char*>( buf);
+    while ( n > 0)
+    {
+        const ssize_t put = pwrite( fileno(f), p, n, off_t(offset));
+        if ( put <= 0)
+            return false;
+        p += put;
+        offset += size_t(put);
+        n -= size_t(put);
+    }   // end while
+    return true;
+#endif
+}   // end writeAt
+
+}   // end namespace
+
+
+StreamedWeights::StreamedWeights( const MatX3fRef &pos, size_t K, float sigma, size_t budget,
+                                  IndexType indexType, size_t nthreads, bool page)
+    : _pos( pos), _K(K), _sigma(sigma), _budget(budget),
+      _kdt( createIndex( viewOf( _pos), indexType, nthreads)),
+      _blocks( (_pos.rows() + BLOCK_ROWS - 1) / BLOCK_ROWS),
+      _paged( _blocks.size(), NOT_PAGED),
+      _file( page ? std::tmpfile() : nullptr, &std::fclose),
+      _kept(0), _numComputed(0)
+{
+}   // end ctor
+
+
+std::shared_ptr<const StreamedWeights::Block> StreamedWeights::block( size_t b) const
+{
+    const size_t r0 = b * BLOCK_ROWS;
+    const size_t n = std::min( BLOCK_ROWS, rows() - r0);
+    const size_t offset = r0 * _K * (sizeof(int) + sizeof(float));
+    bool paged;
+    {
+        std::lock_guard<std::mutex> lock( _mtx);
+        if ( _blocks[b])
+            return _blocks[b];
+        paged = _paged[b] == PAGED;
+    }   // end lock
+
+    // Paged blocks are only read once written and never written again so need no lock.
+    if ( paged)
+    {
+        std::shared_ptr<Block> blk = std::make_shared<Block>();
+        blk->indices.resize( n, _K);
+        blk->weights.resize( n, _K);
+        if ( readAt( _file.get(), offset, blk->indices.data(), n*_K*sizeof(int))
+          && readAt( _file.get(), offset + n*_K*sizeof(int), blk->weights.data(), n*_K*sizeof(float)))
+            return blk;
+        std::lock_guard<std::mutex> lock( _mtx);
+        if ( _paged[b] == PAGED)
+            _paged[b] = NOT_PAGED;  // Recompute it
+    }   // end if
+
+    // Concurrent requests for the same block may each compute it but only one is kept.
+    MatXi idxs;
+    MatXf sqds;
+    _kdt->findn( _pos.middleRows( r0, n), _K, idxs, sqds);
+    std::shared_ptr<Block> blk = std::make_shared<Block>();
+    blk->indices = idxs;
+    blk->weights.resize( n, _K);
+    for ( size_t i = 0; i < n; ++i)
+        SmoothingWeights::calcWeights( &sqds(i,0), size_t(sqds.outerStride()), _K, _sigma, &blk->weights(i,0));
+    _numComputed++;
+
+    const size_t bytes = n * _K * (sizeof(int) + sizeof(float));
+    {
+        std::lock_guard<std::mutex> lock( _mtx);
+        if ( _blocks[b])
+            return _blocks[b];
+        if ( _kept + bytes <= _budget)
+        {
+            _blocks[b] = blk;
+            _kept += bytes;
+            return blk;
+        }   // end if
+        if ( !_file || _paged[b] != NOT_PAGED)
+            return blk;
+        _paged[b] = WRITING;    // By this thread only
+    }   // end lock
+
+    const bool written = writeAt( _file.get(), offset, blk->indices.data(), n*_K*sizeof(int))
+                      && writeAt( _file.get(), offset + n*_K*sizeof(int), blk->weights.data(), n*_K*sizeof(float));
+    std::lock_guard<std::mutex> lock( _mtx);
+    _paged[b] = written ? PAGED : NOT_PAGED;
+    return blk;
+}   // end block
+
+
+size_t StreamedWeights::keptBytes() const
+{
+    std::lock_guard<std::mutex> lock( _mtx);
+    return _kept;
+}   // end keptBytes
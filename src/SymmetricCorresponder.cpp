@@ -16,15 +16,22 @@
  ************************************************************************/
 
 #include <SymmetricCorresponder.h>
+#include <Parallel.h>
 #include <cassert>
+#include <vector>
 using rNonRigid::SymmetricCorresponder;
+using rNonRigid::EllAffinity;
 using rNonRigid::SparseMat;
-using rNonRigid::K3Tree;
+using rNonRigid::K3Index;
+using rNonRigid::MatXf;
+using rNonRigid::MatX3fView;
 using rNonRigid::VecXf;
+using rNonRigid::parallelFor;
+using rNonRigid::parallelInvoke;
 
 
-SymmetricCorresponder::SymmetricCorresponder( size_t k, float h, bool eqpp)
-    : _k(k), _thresh(h), _eqpp(eqpp)
+SymmetricCorresponder::SymmetricCorresponder( size_t k, float h, bool eqpp, size_t nthreads, float maxDist)
+    : _k(k), _thresh(h), _eqpp(eqpp), _nthreads(nthreads), _maxDist(maxDist)
 {
     assert( h >= 0.0f);
     assert( h <= 1.0f);
@@ -32,48 +39,217 @@ SymmetricCorresponder::SymmetricCorresponder( size_t k, float h, bool eqpp)
 
 
 namespace {
-VecXf calcFlags( const SparseMat &A, const VecXf &f, float threshold)
+
+// The rows of the merged push and pull affinities. The pull entries are regrouped by query row
+// with a counting pass rather than by transposing a sparse matrix, and the flags on the target
+// from the independently normalised lookups are found up front, so that each merged row can
+// then be visited, normalised and flagged on its own (and in parallel with the others). The
+// merged rows are held in the given buffers which are reused from call to call.
+class MergedRows
 {
-    assert( A.cols() == f.rows());
-    VecXf F = A * f;
-    for ( long i = 0; i < F.size(); ++i)
-        F[i] = F[i] > threshold ? 1.0f : 0.0f;
-    assert( F.size() == A.rows());
-    return F;
-}   // end calcFlags
+public:
+    using MergeBuffers = SymmetricCorresponder::MergeBuffers;
+
+    MergedRows( const EllAffinity &push, const EllAffinity &pull, bool eqpp, float thresh, size_t nthreads,
+                MergeBuffers &buf)
+        : _push(push), _eqpp(eqpp), _psums( buf.psums), _tflags( buf.tflags), _start( buf.start),
+          _tidx( buf.tidx), _tval( buf.tval)
+    {
+        const size_t n = push.rows();
+        const size_t m = pull.rows();
+        const size_t K = pull.width();
+        push.rowSums( buf.psums);
+        pull.rowSums( buf.qsums);
+        const VecXf &qsums = buf.qsums;
+
+        // Flags on the target from the normalised pull lookups of the flags on the query from
+        // the normalised push lookups (otherwise all target flags are set).
+        buf.tflags.setOnes( m);
+        if ( !eqpp)
+        {
+            VecXf &qflags = buf.qflags;
+            qflags.resize( n);
+            parallelFor( n, nthreads, [&]( size_t b, size_t e)
+            {
+                for ( size_t i = b; i < e; ++i)
+                {
+                    float f = 0.0f;
+                    for ( size_t k = 0; k < push.width() && push.index(i,k) >= 0; ++k)
+                        f += push.value(i,k) / _psums[i];
+                    qflags[i] = f > thresh ? 1.0f : 0.0f;
+                }   // end for
+            }, 1024);
+
+            parallelFor( m, nthreads, [&]( size_t b, size_t e)
+            {
+                for ( size_t j = b; j < e; ++j)
+                {
+                    float f = 0.0f;
+                    for ( size_t k = 0; k < K && pull.index(j,k) >= 0; ++k)
+                        f += pull.value(j,k) / qsums[j] * qflags[pull.index(j,k)];
+                    buf.tflags[j] = f > thresh ? 1.0f : 0.0f;
+                }   // end for
+            }, 1024);
+        }   // end if
+
+        // Count the pull entries for each query row then place them in target order.
+        buf.start.assign( n + 1, 0);
+        for ( size_t j = 0; j < m; ++j)
+            for ( size_t k = 0; k < K && pull.index(j,k) >= 0; ++k)
+                buf.start[pull.index(j,k) + 1]++;
+        for ( size_t i = 0; i < n; ++i)
+            buf.start[i+1] += buf.start[i];
+
+        std::vector<int> &next = buf.next;
+        next.assign( buf.start.begin(), buf.start.end() - 1);
+        buf.tidx.resize( buf.start[n]);
+        buf.tval.resize( buf.start[n]);
+        for ( size_t j = 0; j < m; ++j)
+        {
+            for ( size_t k = 0; k < K && pull.index(j,k) >= 0; ++k)
+            {
+                const int e = next[pull.index(j,k)]++;
+                buf.tidx[e] = int(j);
+                buf.tval[e] = eqpp ? pull.value(j,k) / qsums[j] : pull.value(j,k);
+            }   // end for
+        }   // end for
+    }   // end ctor
+
+    // Calls fn(j,w) for the target row j and (not normalised) affinity w of every entry of row i.
+    template <class Fn>
+    void visit( size_t i, Fn fn) const
+    {
+        for ( size_t k = 0; k < _push.width() && _push.index(i,k) >= 0; ++k)
+            fn( _push.index(i,k), _eqpp ? _push.value(i,k) / _psums[i] : _push.value(i,k));
+        for ( int e = _start[i]; e < _start[i+1]; ++e)
+            fn( _tidx[e], _tval[e]);
+    }   // end visit
+
+    // Returns the sum of the affinities in row i.
+    float rowSum( size_t i) const
+    {
+        float r = 0.0f;
+        visit( i, [&r]( int, float w){ r += w;});
+        return r;
+    }   // end rowSum
+
+    inline float targetFlag( int j) const { return _tflags[j];}
+
+private:
+    const EllAffinity &_push;
+    const bool _eqpp;
+    const VecXf &_psums;
+    const VecXf &_tflags;
+    const std::vector<int> &_start;
+    const std::vector<int> &_tidx;
+    const std::vector<float> &_tval;
+};  // end class
+
 }   // end namespace
 
 
-SparseMat SymmetricCorresponder::operator()( const K3Tree& F, const K3Tree& T, VecXf &fC) const
+void SymmetricCorresponder::_find( const MatX3fView &fpts, const K3Index& F, const K3Index& T,
+                                   WarmStart &ws, K3Index *refitF) const
 {
     // knnF2T will iterate over floating and search for correspondences on target
     // knnT2F will iterate over target and search for correspondences on floating
-    const KNNCorresponder knnF2T( F.data(), _k);  // Push floating to target
-    const KNNCorresponder knnT2F( T.data(), _k);  // Pull floating to target
+    const KNNCorresponder knnF2T( fpts, _k, _nthreads, _maxDist);       // Push floating to target
+    const KNNCorresponder knnT2F( T.data(), _k, _nthreads, _maxDist);   // Pull floating to target
 
-    // For F vertices in the floating set, and T vertices in the target set
-    const SparseMat A_ft = knnF2T.find( T);   // Affinity matrix F x T (not row normalised)
-    const SparseMat A_tf = knnT2F.find( F);   // Affinity matrix T x F (not row normalised)
-    const SparseMat A_ft_n = normaliseRows(A_ft);
-    const SparseMat A_tf_n = normaliseRows(A_tf);
+    // For F vertices in the floating set, and T vertices in the target set. The two directions
+    // share nothing mutable so are searched concurrently. The push search only reads the floating
+    // positions so also overlaps with refitting the floating index which only the pull search uses.
+    // The affinities replace those of the last call, reusing their storage.
+    const bool warm = !ws.stale;
+    ws.stale = false;
+    parallelInvoke( [&](){ knnF2T.affinities( T, ws.push, warm);},   // Affinities F x T (not row normalised)
+                    [&]()
+                    {
+                        if ( refitF)
+                            refitF->refit( fpts);
+                        knnT2F.affinities( F, ws.pull, warm);    // Affinities T x F (not row normalised)
+                    }, _nthreads);
+}   // end _find
 
-    SparseMat A;
-    if ( _eqpp)
-    {
-        A = normaliseRows( A_ft_n + SparseMat( A_tf_n.transpose()));
-        fC = VecXf::Ones(A.cols());
-    }   // end if
-    else
-    {
-        // Check distance thresholds on each lookup independently (requires normalised)
-        fC = calcFlags( A_ft_n, VecXf::Ones(A_ft_n.cols()), _thresh);
-        fC = calcFlags( A_tf_n, fC, _thresh);
-        A = normaliseRows( A_ft + SparseMat( A_tf.transpose()));
-        assert( fC.size() == F.data().rows());
-    }   // end else
 
-    fC = calcFlags( A, fC, _thresh);
+SparseMat SymmetricCorresponder::operator()( const K3Index& F, const K3Index& T, VecXf &fC) const
+{
+    WarmStart ws;
+    _find( F.data(), F, T, ws, nullptr);
+    const MergedRows rows( ws.push, ws.pull, _eqpp, _thresh, _nthreads, ws.merge);
+
+    const size_t n = ws.push.rows();
+    using Triplet = Eigen::Triplet<float>;
+    std::vector<Triplet> tplts;
+    fC.resize( n);
+    for ( size_t i = 0; i < n; ++i)
+    {
+        const float r = rows.rowSum( i);
+        float f = 0.0f;
+        rows.visit( i, [&]( int j, float w)
+        {
+            tplts.push_back( Triplet( int(i), j, w / r));
+            f += w / r * rows.targetFlag( j);
+        });
+        fC[i] = f > _thresh ? 1.0f : 0.0f;
+    }   // end for
 
+    SparseMat A( n, ws.push.cols());
+    A.setFromTriplets( tplts.begin(), tplts.end());
     return A;
 }   // end operator()
 
+
+void SymmetricCorresponder::features( const K3Index& F, const K3Index& T,
+                                      const MatXf &Ff, const MatXf &Tf, VecXf &fC, WarmStart &ws, MatXf &C) const
+{
+    assert( Ff.rows() == long(F.numPoints()));
+    assert( Tf.rows() == long(T.numPoints()));
+    assert( Ff.cols() == Tf.cols());
+    _find( F.data(), F, T, ws, nullptr);
+    _gather( ws, Ff, Tf, fC, C);
+}   // end features
+
+
+void SymmetricCorresponder::refitFeatures( K3Index& F, const K3Index& T,
+                                           const MatXf &Ff, const MatXf &Tf, VecXf &fC, WarmStart &ws, MatXf &C) const
+{
+    assert( Ff.rows() == long(F.numPoints()));
+    assert( Tf.rows() == long(T.numPoints()));
+    assert( Ff.cols() == Tf.cols());
+    const MatX3fView fpts( Ff.data(), Ff.rows(), 3, Eigen::OuterStride<>( Ff.outerStride()));
+    _find( fpts, F, T, ws, &F);
+    _gather( ws, Ff, Tf, fC, C);
+}   // end refitFeatures
+
+
+void SymmetricCorresponder::_gather( WarmStart &ws, const MatXf &Ff, const MatXf &Tf, VecXf &fC, MatXf &C) const
+{
+    const MergedRows rows( ws.push, ws.pull, _eqpp, _thresh, _nthreads, ws.merge);
+
+    const size_t n = ws.push.rows();
+    C.resize( n, Tf.cols());
+    fC.resize( n);
+    parallelFor( n, _nthreads, [&]( size_t b, size_t e)
+    {
+        for ( size_t i = b; i < e; ++i)
+        {
+            const float r = rows.rowSum( i);
+            if ( r <= 0.0f)  // No correspondences so keep the point where it is
+            {
+                C.row(i) = Ff.row(i);
+                fC[i] = 0.0f;
+                continue;
+            }   // end if
+
+            C.row(i).setZero();
+            float f = 0.0f;
+            rows.visit( i, [&]( int j, float w)
+            {
+                C.row(i) += (w / r) * Tf.row(j);
+                f += w / r * rows.targetFlag( j);
+            });
+            fC[i] = f > _thresh ? 1.0f : 0.0f;
+        }   // end for
+    }, 256);
+}   // end _gather
@@ -0,0 +1,238 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <TemplatePackage.h>
+#include <RigidTransformer.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+using rNonRigid::TemplatePackage;
+using rNonRigid::SmoothingWeights;
+using rNonRigid::NeighbourColouring;
+using rNonRigid::SmoothingHierarchy;
+using rNonRigid::VertexOrder;
+using rNonRigid::K3Index;
+using rNonRigid::K3Tree;
+using rNonRigid::MappedFile;
+using rNonRigid::RigidTransformer;
+using rNonRigid::Mat3f;
+using rNonRigid::Mat4f;
+using rNonRigid::Vec3f;
+using rNonRigid::VecXf;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::MatX3fView;
+using rNonRigid::RowMatXiView;
+using rNonRigid::RowMatXfView;
+
+
+namespace {
+
+// Saved packages start with this header. The row-major neighbour indices, their weights, the
+// colour of each vertex, the vertex order (if any) and the saved K3Tree follow in that order at
+// the given offsets (each aligned to K3Tree::fileAlignment bytes so the tree can be loaded in place).
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // ENDIAN_MARK as written (files are in native byte order)
+    uint64_t numPoints;
+    uint64_t K;
+    float sigma;
+    uint32_t reserved;
+    uint64_t indicesOffset;
+    uint64_t weightsOffset;
+    uint64_t coloursOffset;
+    uint64_t orderOffset;   // Zero if the vertices are in their original order
+    uint64_t treeOffset;
+};  // end struct
+
+static const char FILE_MAGIC[8] = {'r','N','R','T','m','p','l','t'};
+static const uint32_t FILE_VERSION = 2;
+static const uint32_t ENDIAN_MARK = 0x01020304;
+
+// Positions count as the package's moved rigidly if each is within this proportion of the
+// largest coordinate (of either set) of the package's position moved by the best fitting
+// rotation and translation, allowing for rounding.
+static const float RIGID_TOL = 1e-4f;
+
+inline uint64_t alignUp( uint64_t off)
+{
+    const uint64_t a = uint64_t( K3Tree::fileAlignment());
+    return (off + a - 1) / a * a;
+}   // end alignUp
+
+}   // end namespace
+
+
+bool TemplatePackage::save( const std::string &fname, const MatX3fRef &pos, size_t K, float sigma, size_t nthreads,
+                            bool reorder)
+{
+    // Built exactly as NonRigidRegistration builds them from the template (in the given vertex order).
+    std::unique_ptr<VertexOrder> vorder;
+    if ( reorder)
+        vorder.reset( new VertexOrder( pos));
+    const K3Tree tree( vorder ? vorder->apply( pos) : MatX3f( pos), 16, nthreads);
+    const SmoothingWeights swts( tree, K, sigma, nthreads);
+    const NeighbourColouring colouring( swts);
+
+    const uint64_t N = uint64_t( pos.rows());
+    FileHeader hdr;
+    std::memset( &hdr, 0, sizeof(FileHeader));
+    std::memcpy( hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    hdr.version = FILE_VERSION;
+    hdr.byteOrder = ENDIAN_MARK;
+    hdr.numPoints = N;
+    hdr.K = uint64_t( K);
+    hdr.sigma = sigma;
+    hdr.indicesOffset = alignUp( sizeof(FileHeader));
+    hdr.weightsOffset = alignUp( hdr.indicesOffset + N * K * sizeof(int));
+    hdr.coloursOffset = alignUp( hdr.weightsOffset + N * K * sizeof(float));
+    hdr.orderOffset = vorder ? alignUp( hdr.coloursOffset + N * sizeof(int)) : 0;
+    hdr.treeOffset = alignUp( (vorder ? hdr.orderOffset : hdr.coloursOffset) + N * sizeof(int));
+
+    std::ofstream ofs( fname, std::ios::binary);
+    const auto writeAt = [&]( uint64_t off, const void *p, uint64_t nbytes)
+    {
+        static const std::vector<char> zeros( K3Tree::fileAlignment(), 0);
+        ofs.write( zeros.data(), std::streamsize( off - uint64_t( ofs.tellp())));
+        ofs.write( static_cast<const char*>( p), std::streamsize( nbytes));
+    };  // end writeAt
+
+    writeAt( 0, &hdr, sizeof(FileHeader));
+    writeAt( hdr.indicesOffset, swts.indices().data(), N * K * sizeof(int));
+    writeAt( hdr.weightsOffset, swts.weights().data(), N * K * sizeof(float));
+    writeAt( hdr.coloursOffset, colouring.colours().data(), N * sizeof(int));
+    if ( vorder)
+        writeAt( hdr.orderOffset, vorder->order().data(), N * sizeof(int));
+    writeAt( hdr.treeOffset, nullptr, 0);
+    return tree.save( ofs) && bool(ofs);
+}   // end save
+
+
+std::shared_ptr<TemplatePackage> TemplatePackage::load( const std::string &fname, size_t nthreads, size_t smoothLevels)
+{
+    const std::shared_ptr<MappedFile> file = MappedFile::open( fname);
+    if ( !file || file->size() < sizeof(FileHeader))
+        return nullptr;
+
+    const FileHeader &hdr = *reinterpret_cast<const FileHeader*>( file->data());
+    if ( std::memcmp( hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0
+            || hdr.version != FILE_VERSION || hdr.byteOrder != ENDIAN_MARK)
+        return nullptr;
+
+    // Check the layout is what save would have written before trusting any offsets.
+    const uint64_t N = hdr.numPoints;
+    const uint64_t K = hdr.K;
+    if ( N > uint64_t(INT32_MAX) || K > N
+            || hdr.indicesOffset != alignUp( sizeof(FileHeader))
+            || hdr.weightsOffset != alignUp( hdr.indicesOffset + N * K * sizeof(int))
+            || hdr.coloursOffset != alignUp( hdr.weightsOffset + N * K * sizeof(float))
+            || (hdr.orderOffset != 0 && hdr.orderOffset != alignUp( hdr.coloursOffset + N * sizeof(int)))
+            || hdr.treeOffset != alignUp( (hdr.orderOffset != 0 ? hdr.orderOffset : hdr.coloursOffset) + N * sizeof(int))
+            || hdr.treeOffset > file->size())
+        return nullptr;
+
+    const std::shared_ptr<K3Tree> tree = K3Tree::load( file, hdr.treeOffset, nthreads);
+    if ( !tree || tree->numPoints() != N)
+        return nullptr;
+
+    const char *base = file->data();
+    const int *colours = reinterpret_cast<const int*>( base + hdr.coloursOffset);
+    for ( uint64_t i = 0; i < N; ++i)
+        if ( colours[i] < 0 || uint64_t( colours[i]) >= N)
+            return nullptr;
+
+    // The neighbours are used as row indices without further checks.
+    const int *nidxs = reinterpret_cast<const int*>( base + hdr.indicesOffset);
+    for ( uint64_t i = 0; i < N * K; ++i)
+        if ( nidxs[i] < 0 || uint64_t( nidxs[i]) >= N)
+            return nullptr;
+
+    // The order must be a permutation of the vertices.
+    VertexOrder *vorder = nullptr;
+    if ( hdr.orderOffset != 0)
+    {
+        const int *order = reinterpret_cast<const int*>( base + hdr.orderOffset);
+        std::vector<bool> seen( N, false);
+        for ( uint64_t i = 0; i < N; ++i)
+        {
+            if ( order[i] < 0 || uint64_t( order[i]) >= N || seen[order[i]])
+                return nullptr;
+            seen[order[i]] = true;
+        }   // end for
+        vorder = new VertexOrder( std::vector<int>( order, order + N));
+    }   // end if
+
+    SmoothingWeights *swts = new SmoothingWeights(
+                RowMatXiView( reinterpret_cast<const int*>( base + hdr.indicesOffset), Eigen::Index(N), Eigen::Index(K)),
+                RowMatXfView( reinterpret_cast<const float*>( base + hdr.weightsOffset), Eigen::Index(N), Eigen::Index(K)),
+                file);
+    return std::shared_ptr<TemplatePackage>( new TemplatePackage( file, size_t( hdr.treeOffset), hdr.sigma, nthreads,
+                                                                  swts, std::vector<int>( colours, colours + N), tree, vorder,
+                                                                  smoothLevels));
+}   // end load
+
+
+TemplatePackage::TemplatePackage( const std::shared_ptr<MappedFile> &file, size_t treeOffset, float sigma, size_t nthreads,
+                                  SmoothingWeights *swts, const std::vector<int> &colours, const std::shared_ptr<K3Tree> &tree,
+                                  VertexOrder *vorder, size_t smoothLevels)
+    : _file( file), _treeOffset( treeOffset), _sigma( sigma), _nthreads( nthreads),
+      _swts( swts), _colouring( colours), _tree( tree), _order( vorder),
+      _hierarchyLevels( smoothLevels > 1 ? smoothLevels : 0),
+      _hierarchy( smoothLevels > 1 ? new SmoothingHierarchy( *_swts, _tree->data(), smoothLevels) : nullptr)
+{
+}   // end ctor
+
+
+bool TemplatePackage::matches( const MatX3fRef &pos, size_t K, float sigma) const
+{
+    const size_t N = numPoints();
+    if ( size_t( pos.rows()) != N || K != this->K() || sigma != _sigma)
+        return false;
+
+    // The positions in the package's order
+    const MatX3fView Q = _tree->data();
+    MatX3f P( N, 3);
+    if ( _order)
+    {
+        const std::vector<int> &order = _order->order();
+        for ( size_t i = 0; i < N; ++i)
+            P.row(i) = pos.row(order[i]);
+    }   // end if
+    else
+        P = pos;
+    if ( P == Q)
+        return true;
+
+    // The weights, colouring and hierarchy depend only on the distances between the positions
+    // so still hold (up to rounding) if the template has since been moved rigidly.
+    const Mat4f T = RigidTransformer( false)( Q, P, VecXf::Ones( N));
+    const Mat3f R = T.block<3,3>(0,0);
+    const Vec3f t = T.block<3,1>(0,3);
+    const float tol = RIGID_TOL * std::max( P.cwiseAbs().maxCoeff(), Q.cwiseAbs().maxCoeff());
+    for ( size_t i = 0; i < N; ++i)
+        if ( (R * Q.row(i).transpose() + t - P.row(i).transpose()).squaredNorm() > tol * tol)
+            return false;
+    return true;
+}   // end matches
+
+
+std::shared_ptr<K3Index> TemplatePackage::newIndex() const
+{
+    return K3Tree::load( _file, _treeOffset, _nthreads);
+}   // end newIndex
@@ -16,79 +16,143 @@
  ************************************************************************/
 
 #include <Types.h>
+#include <Parallel.h>
+#include <algorithm>
 #include <cassert>
 using rNonRigid::Mesh;
 using rNonRigid::FaceMat;
 using rNonRigid::MatX6f;
 using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::Mat3f;
 using rNonRigid::Mat4f;
 using rNonRigid::MatXf;
 using rNonRigid::Vec3f;
-using rNonRigid::Vec3i;
+using rNonRigid::parallelFor;
 
 
 namespace {
 
-void updateNorms( MatXf &F, const FaceMat &H)
+// Faces are processed in fixed size blocks whose edges are gathered into contiguous arrays
+// so the cross products vectorise. Every face goes through the same full block arithmetic
+// wherever a chunk happens to end, so face normals don't depend on the number of threads.
+constexpr int FACE_BLOCK = 64;
+using FaceBlock = Eigen::Array<float, FACE_BLOCK, 1>;
+
+void faceNorms( const MatXf &F, const FaceMat &H, MatX3f &N, size_t i0, size_t i1)
 {
-    // Then get the area weighted norms of the faces and add to all associated vertices
-    const size_t NF = H.rows();
-    for ( size_t i = 0; i < NF; ++i)
+    FaceBlock ux, uy, uz, wx, wy, wz;
+    for ( size_t i = i0; i < i1; i += FACE_BLOCK)
     {
-        const Vec3i vtxs = H.row(i); // Corresponding vertex rows for this face
-        const int a = vtxs[0];
-        const int b = vtxs[1];
-        const int c = vtxs[2];
-
-        // Get the corresponding updated positions
-        const Vec3f vA = F.block<1,3>(a,0);
-        const Vec3f vB = F.block<1,3>(b,0);
-        const Vec3f vC = F.block<1,3>(c,0);
-
-        // Calculate area weighted triangle norm (magnitude is twice the triangle's area)
-        const Vec3f fnrm = (vB - vA).cross( vC - vB);
-
-        // Add back to the associated vertices
-        F.block<1,3>(a,3) += fnrm;
-        F.block<1,3>(b,3) += fnrm;
-        F.block<1,3>(c,3) += fnrm;
-    }   // end for
+        const int m = int(std::min<size_t>( FACE_BLOCK, i1 - i));
+        for ( int k = 0; k < m; ++k)
+        {
+            const int a = H(i+k,0);
+            const int b = H(i+k,1);
+            const int c = H(i+k,2);
+            ux[k] = F(b,0) - F(a,0);
+            uy[k] = F(b,1) - F(a,1);
+            uz[k] = F(b,2) - F(a,2);
+            wx[k] = F(c,0) - F(b,0);
+            wy[k] = F(c,1) - F(b,1);
+            wz[k] = F(c,2) - F(b,2);
+        }   // end for
 
-    // Finally renormalise the vertex normals.
-    const size_t N = F.rows();
-    for ( size_t i = 0; i < N; ++i)
-        F.block(i, 3, 1, 3).normalize();  // Normalise in place
-}   // end updateNorms
+        // Area weighted triangle norm (vB - vA) x (vC - vB) (magnitude is twice the triangle's area)
+        const FaceBlock nx = uy*wz - uz*wy;
+        const FaceBlock ny = uz*wx - ux*wz;
+        const FaceBlock nz = ux*wy - uy*wx;
+        N.col(0).segment(i,m) = nx.head(m);
+        N.col(1).segment(i,m) = ny.head(m);
+        N.col(2).segment(i,m) = nz.head(m);
+    }   // end for
+}   // end faceNorms
 
 }   // end namespace
 
 
 
-void Mesh::update( const MatX3f &D)
+void Mesh::update( const MatX3fRef &D, size_t nthreads)
 {
     // First update vertex positions (first three columns of F) by adding the displacement map
-    const size_t N = features.rows();
-    assert( D.rows() == N);
+    assert( size_t(D.rows()) == size_t(features.rows()));
     features.leftCols<3>() += D;
     if ( features.cols() >= 6 && topology.rows() > 0)
-    {
-        features.block(0,3,N,3) = MatX3f::Zero(N, 3);
-        updateNorms( features, topology);
-    }   // end if
+        updateNormals( nthreads);
 }   // end update
 
 
+void Mesh::topologyChanged()
+{
+    _vfStarts.clear();
+    _vfaces.clear();
+}   // end topologyChanged
+
+
+void Mesh::_buildAdjacency()
+{
+    // Counting sort of the (vertex, face) incidences by vertex. Faces are visited in increasing
+    // order so each vertex's faces are too (a degenerate face is listed once per corner).
+    const size_t N = features.rows();
+    const size_t NF = topology.rows();
+    _vfStarts.assign( N+1, 0);
+    for ( size_t i = 0; i < NF; ++i)
+        for ( int j = 0; j < 3; ++j)
+            _vfStarts[topology(i,j) + 1]++;
+    for ( size_t i = 0; i < N; ++i)
+        _vfStarts[i+1] += _vfStarts[i];
+    _vfaces.resize( 3*NF);
+    std::vector<int> next( _vfStarts.begin(), _vfStarts.end() - 1);
+    for ( size_t i = 0; i < NF; ++i)
+        for ( int j = 0; j < 3; ++j)
+            _vfaces[next[topology(i,j)]++] = int(i);
+}   // end _buildAdjacency
+
+
+void Mesh::updateNormals( size_t nthreads)
+{
+    assert( features.cols() >= 6);
+    const size_t N = features.rows();
+    const size_t NF = topology.rows();
+    if ( _vfStarts.size() != N+1 || _vfaces.size() != 3*NF)
+        _buildAdjacency();
+
+    // Area weighted normals of the faces, then the sum over each vertex's faces gathered in
+    // increasing face order (the order the faces were once scattered to their vertices in).
+    _fnrms.resize( NF, 3);
+    parallelFor( NF, nthreads, [this]( size_t i0, size_t i1){ faceNorms( features, topology, _fnrms, i0, i1);}, 1024);
+    parallelFor( N, nthreads, [this]( size_t i0, size_t i1)
+    {
+        for ( size_t i = i0; i < i1; ++i)
+        {
+            Vec3f nrm = Vec3f::Zero();
+            for ( int k = _vfStarts[i]; k < _vfStarts[i+1]; ++k)
+                nrm += _fnrms.row(_vfaces[k]).transpose();
+            nrm.normalize();
+            features.block<1,3>(i,3) = nrm.transpose();
+        }   // end for
+    }, 1024);
+}   // end updateNormals
+
+
 void Mesh::transform( const Mat4f &T)
 {
+    // Positions are transformed as homogeneous points and normals are rotated, a row at a time
+    // in place rather than through copies of the columns.
     const size_t N = features.rows();
-    MatX4f ft( N, 4);
-    ft.leftCols<3>() = features.leftCols<3>();
-    ft.rightCols<1>() = VecXf::Ones(N);
-    features.leftCols<3>() = (ft * T.transpose()).leftCols<3>();
-    if ( features.cols() >= 6)
+    const Mat3f A = T.block<3,3>(0,0);
+    const Vec3f t = T.block<3,1>(0,3);
+    const bool hasNormals = features.cols() >= 6;
+    const Mat3f R = A / T(3,3); // Rotation submatrix (with possible scaling factor)
+    for ( size_t i = 0; i < N; ++i)
     {
-        const Mat3f R = T.block<3,3>(0,0) / T(3,3); // Rotation submatrix (with possible scaling factor)
-        features.block(0,3,N,3) = features.block(0,3,N,3) * R.transpose();
-    }   // end if
+        const Vec3f p = features.block<1,3>(i,0).transpose();
+        features.block<1,3>(i,0) = (A * p + t).transpose();
+        if ( hasNormals)
+        {
+            const Vec3f n = features.block<1,3>(i,3).transpose();
+            features.block<1,3>(i,3) = (R * n).transpose();
+        }   // end if
+    }   // end for
 }   // end transform
 
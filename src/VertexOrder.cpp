@@ -0,0 +1,139 @@
+/************************************************************************
+ * Copyright (C) 2021 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <VertexOrder.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <numeric>
+using rNonRigid::VertexOrder;
+using rNonRigid::Mesh;
+using rNonRigid::MatX3f;
+using rNonRigid::MatX3fRef;
+using rNonRigid::VecXf;
+using rNonRigid::Vec3f;
+
+
+namespace {
+
+static const int MORTON_BITS = 21;  // Bits per axis so that the interleaved code fits in 64 bits
+
+// Spread the low 21 bits of v so that there are two zero bits between each.
+inline uint64_t spreadBits( uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}   // end spreadBits
+
+}   // end namespace
+
+
+VertexOrder::VertexOrder( const MatX3fRef &pos)
+{
+    const size_t N = pos.rows();
+    std::vector<uint64_t> codes( N);
+    if ( N > 0)
+    {
+        const Vec3f lo = pos.colwise().minCoeff();
+        const Vec3f ext = pos.colwise().maxCoeff().transpose() - lo;
+        const float cells = float( (1 << MORTON_BITS) - 1);
+        const float scale = cells / std::max( ext.maxCoeff(), 1e-12f); // Cells are cubes
+        for ( size_t i = 0; i < N; ++i)
+        {
+            uint64_t code = 0;
+            for ( int c = 0; c < 3; ++c)
+            {
+                const float q = std::min( std::max( (pos(i,c) - lo[c]) * scale, 0.0f), cells);
+                code |= spreadBits( uint64_t(q)) << c;
+            }   // end for
+            codes[i] = code;
+        }   // end for
+    }   // end if
+
+    _order.resize( N);
+    std::iota( _order.begin(), _order.end(), 0);
+    std::stable_sort( _order.begin(), _order.end(), [&]( int a, int b){ return codes[a] < codes[b];});
+    _setRank();
+}   // end ctor
+
+
+VertexOrder::VertexOrder( const std::vector<int> &order) : _order( order)
+{
+    _setRank();
+}   // end ctor
+
+
+void VertexOrder::_setRank()
+{
+    _rank.assign( _order.size(), -1);
+    for ( size_t i = 0; i < _order.size(); ++i)
+    {
+        assert( _order[i] >= 0 && size_t(_order[i]) < _order.size() && _rank[_order[i]] < 0);
+        _rank[_order[i]] = int(i);
+    }   // end for
+}   // end _setRank
+
+
+MatX3f VertexOrder::apply( const MatX3fRef &pos) const
+{
+    assert( size_t(pos.rows()) == size());
+    MatX3f opos( pos.rows(), 3);
+    for ( size_t i = 0; i < _order.size(); ++i)
+        opos.row(i) = pos.row(_order[i]);
+    return opos;
+}   // end apply
+
+
+void VertexOrder::apply( Mesh &mesh) const
+{
+    assert( size_t(mesh.features.rows()) == size());
+    // Permuted a column at a time through a single column of scratch so the features keep
+    // their storage (and any views of it stay valid).
+    VecXf col( mesh.features.rows());
+    for ( int j = 0; j < mesh.features.cols(); ++j)
+    {
+        for ( size_t i = 0; i < _order.size(); ++i)
+            col[i] = mesh.features(_order[i], j);
+        mesh.features.col(j) = col;
+    }   // end for
+    for ( int j = 0; j < mesh.topology.cols(); ++j)
+        for ( int i = 0; i < mesh.topology.rows(); ++i)
+            mesh.topology(i,j) = _rank[mesh.topology(i,j)];
+    mesh.topologyChanged();
+}   // end apply
+
+
+void VertexOrder::restore( Mesh &mesh) const
+{
+    assert( size_t(mesh.features.rows()) == size());
+    VecXf col( mesh.features.rows());
+    for ( int j = 0; j < mesh.features.cols(); ++j)
+    {
+        for ( size_t i = 0; i < _order.size(); ++i)
+            col[_order[i]] = mesh.features(i, j);
+        mesh.features.col(j) = col;
+    }   // end for
+    for ( int j = 0; j < mesh.topology.cols(); ++j)
+        for ( int i = 0; i < mesh.topology.rows(); ++i)
+            mesh.topology(i,j) = _order[mesh.topology(i,j)];
+    mesh.topologyChanged();
+}   // end restore
@@ -16,85 +16,560 @@
  ************************************************************************/
 
 #include <ViscoElasticTransformer.h>
+#include <KDispatch.h>
+#include <Parallel.h>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <memory>
+#include <vector>
 using rNonRigid::ViscoElasticTransformer;
 using rNonRigid::SmoothingWeights;
-using rNonRigid::MatX6f;
+using rNonRigid::SmoothingHierarchy;
+using rNonRigid::NeighbourColouring;
+using rNonRigid::CompactWeights;
+using rNonRigid::StreamedWeights;
+using rNonRigid::KBuffer;
 using rNonRigid::MatX3f;
-using rNonRigid::MatX3f;
-using rNonRigid::MatXf;
-using rNonRigid::MatXi;
+using rNonRigid::RowMatXf;
+using rNonRigid::RowMatXi;
+using rNonRigid::RowMatXiView;
+using rNonRigid::RowMatXfView;
 using rNonRigid::VecXf;
 using rNonRigid::Vec3f;
+using rNonRigid::numK;
+using rNonRigid::dispatchK;
+using rNonRigid::parallelFor;
 
 
 namespace {
 
-MatXf createWeights( const SmoothingWeights &swts, const VecXf &iwts)
+static const float WEIGHT_EPS = 1e-5f;  // Smoothing weights modulated by inlier weights are rescaled in [EPS,1]
+static const size_t VCYCLE_SWEEPS = 2;  // Sweeps on each level either side of relaxing the next coarser level
+
+// A displacement field held row-major during regularisation so that the neighbours of a vertex
+// are gathered as contiguous rows. The fourth column holds each vertex's inlier weight (scaled
+// by 1-EPS) so that it's gathered with the displacement rather than from a separate array.
+using Field4 = ViscoElasticTransformer::Workspace::Field4;
+using Row4f = Eigen::Matrix<float, 1, 4>;
+using Field3 = Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor>;  // Coarse level fields
+
+// The kernels below are specialised for the number of smoothing neighbours FK (see KDispatch.h).
+// They take their rows from the smoothing weights, their compact copy or the streamed blocks
+// through neighbourRows, which returns a reader for each chunk of vertices.
+
+// Reads the rows of the smoothing weights in place...
+template <size_t FK>
+struct FloatRows
 {
-    static const float EPS = 1e-5f;
-    static const float ONE_MINUS_EPS = 1.0f - EPS;
-    const size_t N = swts.indices().rows();  // Number of vertices in field
-    const size_t K = swts.indices().cols();  // Number of neighbours of each vertex to iterate over
+    explicit FloatRows( const SmoothingWeights &w) : swts(w), K( numK<FK>( w.indices().cols())) {}
+    inline void get( size_t i, const int *&nidxs, const float *&wts)
+    {
+        nidxs = swts.indices().row(i).data();
+        wts = swts.weights().row(i).data();
+    }   // end get
+    const SmoothingWeights &swts;
+    const size_t K;
+};  // end struct
 
-    MatXf wts(N, K);
-    for ( size_t i = 0; i < N; ++i)
+// ...or decodes the rows of their compact copy into buffers.
+template <size_t FK>
+struct CompactRows
+{
+    explicit CompactRows( const CompactWeights &w) : cw(w), K( numK<FK>( w.cols())), ibuf(K), wbuf(K) {}
+    inline void get( size_t i, const int *&nidxs, const float *&wts)
     {
-        for ( size_t k = 0; k < K; ++k) // Typically 80 or so vertices nearest to i
+        cw.template decode<FK>( i, ibuf.data(), wbuf.data());
+        nidxs = ibuf.data();
+        wts = wbuf.data();
+    }   // end get
+    const CompactWeights &cw;
+    const size_t K;
+    KBuffer<int, FK> ibuf;
+    KBuffer<float, FK> wbuf;
+};  // end struct
+
+// ...or reads the rows of the blocks of streamed weights, holding on to the current block.
+template <size_t FK>
+struct StreamedRows
+{
+    explicit StreamedRows( const StreamedWeights &w) : sw(w), K( numK<FK>( w.cols())), b(0), e(0) {}
+    inline void get( size_t i, const int *&nidxs, const float *&wts)
+    {
+        if ( i < b || i >= e)
         {
-            const size_t j = swts.indices()(i,k);   // Neighbour index
-            wts(i,k) = ONE_MINUS_EPS * iwts[j] * swts.weights()(i,k) + EPS;  // Rescale weight in [EPS,1]
+            blk = sw.block( i / StreamedWeights::BLOCK_ROWS);
+            b = i - i % StreamedWeights::BLOCK_ROWS;
+            e = b + blk->indices.rows();
+        }   // end if
+        nidxs = &blk->indices(i-b,0);
+        wts = &blk->weights(i-b,0);
+    }   // end get
+    const StreamedWeights &sw;
+    const size_t K;
+    std::shared_ptr<const StreamedWeights::Block> blk;
+    size_t b, e;
+};  // end struct
+
+template <size_t FK>
+FloatRows<FK> neighbourRows( const SmoothingWeights &w) { return FloatRows<FK>( w);}
+
+template <size_t FK>
+StreamedRows<FK> neighbourRows( const StreamedWeights &w) { return StreamedRows<FK>( w);}
+
+template <size_t FK>
+CompactRows<FK> neighbourRows( const CompactWeights &w) { return CompactRows<FK>( w);}
+
+
+// Set the sum of the smoothing weights over all neighbours of each vertex after modulating
+// by the (scaled) inlier weights of the neighbours.
+template <size_t FK, typename W>
+void weightSums( const W &swts, const VecXf &mwts, VecXf &wsums, size_t nthreads)
+{
+    const size_t N = mwts.size();
+    wsums.resize( N);
+    parallelFor( N, nthreads, [&]( size_t b, size_t e)
+    {
+        auto rows = neighbourRows<FK>( swts);
+        for ( size_t i = b; i < e; ++i)
+        {
+            const int *nidxs;
+            const float *swt;
+            rows.get( i, nidxs, swt);
+            float wsum = 0.0f;
+            for ( size_t k = 0; k < rows.K; ++k)
+                wsum += mwts[nidxs[k]] * swt[k] + WEIGHT_EPS;
+            wsums[i] = wsum;
         }   // end for
+    }, 512);
+}   // end weightSums
+
+
+// Jacobi style relaxation of M: every sweep replaces each vector with the weighted average of
+// the vectors of its neighbours from the previous sweep. The weights are modulated by the inlier
+// weights of the neighbours on the fly and sweeps alternate between M and tmp.
+template <size_t FK, typename W>
+void regularise( Field4 &M, Field4 &tmp, const W &swts, const VecXf &wsums,
+                 size_t nSteps, size_t nthreads)
+{
+    const size_t N = M.rows();  // Number of vertices in field
+
+    for ( size_t it = 0; it < nSteps; ++it)
+    {
+        parallelFor( N, nthreads, [&]( size_t b, size_t e)
+        {
+            auto rows = neighbourRows<FK>( swts);
+            const size_t K = rows.K - 1;  // Number of neighbours of each vertex to iterate over
+            for ( size_t i = b; i < e; ++i)
+            {
+                const int *nidxs;
+                const float *swt;
+                rows.get( i, nidxs, swt);
+                Row4f vavg = Row4f::Zero();
+                for ( size_t k = 0; k < K; ++k) // Typically 80 or so vertices nearest to i
+                {
+                    const auto v = M.row(nidxs[k]);
+                    vavg += v * (v[3] * swt[k] + WEIGHT_EPS);
+                }   // end for
+                tmp.row(i) = vavg / wsums[i];
+                tmp(i,3) = M(i,3);
+            }   // end for
+        }, 512);
+        M.swap( tmp);
     }   // end for
+}   // end regularise
 
-    return wts;
-}   // end createWeights
 
+// Returns the coefficients of the Chebyshev expansion of x^n on [-1,1] up to the given degree:
+// x^n = sum_k c_k T_k(x) where c_k = 2^(1-n) C(n,(n-k)/2) for k of the same parity as n
+// (halved for k=0) and zero otherwise. The coefficients are positive and sum to one.
+std::vector<double> powerCoeffs( size_t n, size_t degree)
+{
+    std::vector<double> c( std::min( degree, n) + 1, 0.0);
+    const double lgn = std::lgamma( double(n) + 1.0) + (1.0 - double(n)) * std::log( 2.0);
+    for ( size_t k = n % 2; k < c.size(); k += 2)
+    {
+        const double m = double(n - k) / 2;
+        c[k] = std::exp( lgn - std::lgamma( m + 1.0) - std::lgamma( double(n) - m + 1.0));
+        if ( k == 0)
+            c[k] *= 0.5;
+    }   // end for
+    return c;
+}   // end powerCoeffs
 
-void regularise( MatX3f &M, const MatXf &wts, const VecXf &wRowSums, const MatXi &nidxs, size_t nSteps)
+
+// Returns the maximum error on [-1,1] of approximating x^n with its Chebyshev expansion
+// truncated to the given degree (the sum of the dropped coefficients since |T_k| <= 1).
+double powerError( size_t n, size_t degree)
 {
-    const size_t N = wts.rows();  // Number of vertices in field
-    const size_t K = wts.cols() - 1;  // Number of neighbours of each vertex to iterate over
-    MatX3f rM( N, 3);
+    if ( degree >= n)
+        return 0.0;
+    const std::vector<double> c = powerCoeffs( n, n);
+    double err = 0.0;
+    for ( size_t k = n; k > degree; --k)
+        err += c[k];
+    return err;
+}   // end powerError
 
-    for ( size_t it = 0; it < nSteps; ++it)
+
+// Returns the lowest degree whose Chebyshev approximation of x^n has error at most tol.
+size_t powerDegree( size_t n, double tol)
+{
+    const std::vector<double> c = powerCoeffs( n, n);
+    double err = 0.0;
+    size_t d = n;
+    while ( d > 0 && err + c[d] <= tol)
+        err += c[d--];
+    return d;
+}   // end powerDegree
+
+
+// Set the weights of the smoothing operator W applied by each regularisation sweep
+// (row i averages its first K-1 neighbours) in the same (row-major) layout as the neighbours.
+template <size_t FK, typename W>
+void operatorWeights( const W &swts, const VecXf &mwts, const VecXf &wsums, RowMatXf &A, size_t nthreads)
+{
+    const size_t N = mwts.size();
+    A.resize( N, neighbourRows<FK>( swts).K - 1);
+    parallelFor( N, nthreads, [&]( size_t b, size_t e)
     {
-        for ( size_t i = 0; i < N; ++i)
+        auto rows = neighbourRows<FK>( swts);
+        const size_t K = rows.K - 1;
+        const int *nidxs;
+        const float *wts;
+        for ( size_t i = b; i < e; ++i)
         {
-            Vec3f vavg = Vec3f::Zero();
-            for ( size_t k = 0; k < K; ++k) // Typically 80 or so vertices nearest to i
-                vavg += M.row(nidxs(i,k)) * wts(i,k);
-            rM.row(i) = vavg / wRowSums[i];
+            rows.get( i, nidxs, wts);
+            for ( size_t k = 0; k < K; ++k)
+                A(i,k) = (mwts[nidxs[k]] * wts[k] + WEIGHT_EPS) / wsums[i];
         }   // end for
+    }, 512);
+}   // end operatorWeights
+
 
-        M = rM;
+// Returns the symmetric kernel G of the mutual neighbours of the smoothing weights in the same
+// layout as the first K-1 neighbours of each vertex (those averaged by a sweep). G_ij is the
+// geometric mean of the weights of i and j for each other with each row of the weights divided
+// by its largest (that of the vertex itself at distance zero), or zero if i isn't among the
+// first K-1 neighbours of j. Depends only on the template so is made once on construction.
+template <typename W>
+RowMatXf symmetricKernel( const W &swts, size_t N, size_t nthreads)
+{
+    std::vector<float> gmax( N);
+    parallelFor( N, nthreads, [&]( size_t b, size_t e)
+    {
+        auto rows = neighbourRows<0>( swts);
+        const int *nidxs;
+        const float *wts;
+        for ( size_t i = b; i < e; ++i)
+        {
+            rows.get( i, nidxs, wts);
+            gmax[i] = *std::max_element( wts, wts + rows.K);
+        }   // end for
+    }, 4096);
+
+    const size_t K = neighbourRows<0>( swts).K - 1;
+    RowMatXf G( N, K);
+    parallelFor( N, nthreads, [&]( size_t b, size_t e)
+    {
+        auto rows = neighbourRows<0>( swts);
+        auto jrows = neighbourRows<0>( swts);
+        const int *nidxs, *jidxs;
+        const float *wts, *jwts;
+        for ( size_t i = b; i < e; ++i)
+        {
+            rows.get( i, nidxs, wts);
+            for ( size_t k = 0; k < K; ++k)
+            {
+                const int j = nidxs[k];
+                jrows.get( j, jidxs, jwts);
+                const int *it = std::find( jidxs, jidxs + K, int(i));
+                G(i,k) = it == jidxs + K ? 0.0f : std::sqrt( wts[k] * jwts[it - jidxs] / (gmax[i] * gmax[j]));
+            }   // end for
+        }   // end for
+    }, 256);
+    return G;
+}   // end symmetricKernel
+
+
+// Set the weights of a symmetrised smoothing operator W' = R D^-1 S in the same layout as the
+// neighbours. S keeps only the mutual neighbours and weights them by a symmetric kernel
+// s_ij = m_i m_j G_ij with inlier weights m (offset by EPS) and G from symmetricKernel.
+// D holds the row sums of S so that, with the m_i of row i cancelling, each row weights its
+// neighbours j by m_j G_ij just as a sweep does. R scales each row to sum to the same as the rows
+// of a sweep (slightly under one since a sweep averages K-1 neighbours normalised by the weights
+// of all K). W' is similar to the symmetric (D R^-1)^-1/2 S (D R^-1)^-1/2 so its eigenvalues are
+// real and, since its rows are positive and sum to at most one, in [-1,1].
+template <size_t FK, typename W>
+void symmetricOperatorWeights( const W &swts, const RowMatXf &G, const VecXf &mwts,
+                               const VecXf &wsums, RowMatXf &A, size_t nthreads)
+{
+    const size_t N = G.rows();
+    A.resize( N, G.cols());
+    parallelFor( N, nthreads, [&]( size_t b, size_t e)
+    {
+        auto rows = neighbourRows<FK>( swts);
+        const size_t K = rows.K - 1;
+        const int *nidxs;
+        const float *wts;
+        for ( size_t i = b; i < e; ++i)
+        {
+            rows.get( i, nidxs, wts);
+            float ssum = 0.0f;  // Sum of the row of S (over m_i)
+            float wsum = 0.0f;  // Sum of the row of a sweep (times wsums[i])
+            for ( size_t k = 0; k < K; ++k)
+            {
+                const int j = nidxs[k];
+                A(i,k) = (mwts[j] + WEIGHT_EPS) * G(i,k);
+                ssum += A(i,k);
+                wsum += mwts[j] * wts[k] + WEIGHT_EPS;
+            }   // end for
+            A.row(i) *= wsum / (wsums[i] * ssum);   // At least i itself is its own mutual neighbour
+        }   // end for
+    }, 512);
+}   // end symmetricOperatorWeights
+
+
+// Approximate nSteps applications of the smoothing operator W (M <- W^n M) by p(W) M where p is
+// the truncated Chebyshev expansion of x^n with the given coefficients. Each term costs one
+// application of W using the three term recurrence T_0 = I, T_1 = W, T_d = 2 W T_{d-1} - T_{d-2}.
+// The expansion is accurate to the truncation error only for W with a real spectrum in [-1,1]
+// such as the symmetrised operator above (but not that of regularise whose eigenvalues can be
+// complex, where T_d(W) isn't bounded). The terms are held in the workspace's Chebyshev buffers and tmp.
+template <size_t FK, typename W>
+void chebyshevPower( Field4 &M, const W &swts, const RowMatXf &A,
+                     const std::vector<double> &c, ViscoElasticTransformer::Workspace &ws, size_t nthreads)
+{
+    const size_t N = M.rows();
+    const size_t K = numK<FK>( A.cols() + 1) - 1;
+    Field4 &acc = ws.acc;
+    Field4 &t0 = ws.t0, &t1 = ws.t1, &t2 = ws.tmp;    // T_{d-2}, T_{d-1} and T_d applied to M
+    acc = float(c[0]) * M;
+    t0.resize( N, 4);
+    t1 = M;
+    t2.resize( N, 4);
+    for ( size_t d = 1; d < c.size(); ++d)
+    {
+        const float a = d == 1 ? 1.0f : 2.0f;
+        const float cd = float(c[d]);
+        parallelFor( N, nthreads, [&]( size_t b, size_t e)
+        {
+            auto rows = neighbourRows<FK>( swts);
+            const int *nidxs;
+            const float *wts;
+            for ( size_t i = b; i < e; ++i)
+            {
+                rows.get( i, nidxs, wts);
+                const float *w = &A(i,0);
+                Row4f v = Row4f::Zero();
+                for ( size_t k = 0; k < K; ++k)
+                    v += w[k] * t1.row(nidxs[k]);
+                t2.row(i) = d == 1 ? v : Row4f( a * v - t0.row(i));
+                if ( cd != 0.0f)
+                    acc.row(i) += cd * t2.row(i);
+            }   // end for
+        }, 512);
+        t0.swap( t1);
+        t1.swap( t2);
     }   // end for
-}   // end regularise
+    M.leftCols<3>() = acc.leftCols<3>();
+}   // end chebyshevPower
+
+
+// Returns the average of the (first three columns of) the vectors of the members of each cluster on level l.
+template <typename F>
+Field3 restrictField( const SmoothingHierarchy &H, size_t l, const F &V)
+{
+    const std::vector<int> &cluster = H.clusters(l);
+    const std::vector<float> &invSize = H.invSizes(l);
+    Field3 C = Field3::Zero( H.size(l), 3);
+    for ( size_t i = 0; i < cluster.size(); ++i)
+        C.row(cluster[i]) += invSize[cluster[i]] * V.row(i).template head<3>();
+    return C;
+}   // end restrictField
+
+
+// Add to the (first three columns of) each vector on level l-1 the vector of its cluster in D.
+template <typename F>
+void prolongAdd( const SmoothingHierarchy &H, size_t l, const Field3 &D, F &V, size_t nthreads)
+{
+    const std::vector<int> &cluster = H.clusters(l);
+    parallelFor( cluster.size(), nthreads, [&]( size_t b, size_t e)
+    {
+        for ( size_t i = b; i < e; ++i)
+            V.row(i).template head<3>() += D.row(cluster[i]);
+    }, 4096);
+}   // end prolongAdd
+
+
+// Coarse level operators for a V-cycle: the Galerkin operators of the hierarchy for the smoothing
+// operator A with the sum of each of their rows and the number of sweeps of A that a sweep on each
+// level stands in for. Diffusion spreads a vector in proportion to the number of sweeps times the
+// mean squared distance a sweep moves it (the spread of the operator over the level's positions).
+struct CoarseOperators
+{
+    template <typename W>
+    CoarseOperators( const SmoothingHierarchy &h, const W &swts, const RowMatXf &A)
+        : H(h), vals( h.coarseOperators( A)), rowSums( vals.size()), sweepsPer( h.numLevels(), 1.0)
+    {
+        const MatX3f &p0 = H.positions(0);
+        double spread0 = 0.0;
+        auto rows = neighbourRows<0>( swts);
+        const int *nidxs;
+        const float *wts;
+        for ( size_t i = 0; i < H.size(0); ++i)
+        {
+            rows.get( i, nidxs, wts);
+            double wsum = 0.0, wsq = 0.0;
+            for ( int k = 0; k < A.cols(); ++k)
+            {
+                wsum += A(i,k);
+                wsq += A(i,k) * (p0.row( nidxs[k]) - p0.row(i)).squaredNorm();
+            }   // end for
+            spread0 += wsq / wsum;
+        }   // end for
+
+        for ( size_t l = 1; l < H.numLevels(); ++l)
+        {
+            const std::vector<int> &rs = H.rowStarts(l);
+            const std::vector<int> &cols = H.columns(l);
+            const MatX3f &pl = H.positions(l);
+            rowSums[l-1].resize( H.size(l));
+            double spread = 0.0;
+            for ( size_t i = 0; i < H.size(l); ++i)
+            {
+                double wsum = 0.0, wsq = 0.0;
+                for ( int j = rs[i]; j < rs[i+1]; ++j)
+                {
+                    wsum += vals[l-1][j];
+                    wsq += vals[l-1][j] * (pl.row( cols[j]) - pl.row(i)).squaredNorm();
+                }   // end for
+                rowSums[l-1][i] = float(wsum);
+                spread += wsq / wsum;
+            }   // end for
+            sweepsPer[l] = (spread / double(H.size(l))) / (spread0 / double(H.size(0)));
+        }   // end for
+    }   // end ctor
+
+    // Returns the number of sweeps on level l that best stand in for m sweeps of A.
+    inline size_t sweeps( size_t l, double m) const { return size_t( std::max( 0.0, std::round( m / sweepsPer[l])));}
+
+    const SmoothingHierarchy &H;
+    const std::vector<std::vector<float> > vals;
+    std::vector<std::vector<float> > rowSums;
+    std::vector<double> sweepsPer;
+};  // end struct
+
+
+// Jacobi sweeps of the operator of coarse level l alternating between C and tmp where each sweep
+// stands in for p sweeps of the template's operator. Since the rows of the template's operator sum
+// to a little less than one (sweeps average over all but the last neighbour), vectors decay a little
+// with every sweep so each coarse row is rescaled to sum to its sum raised to the power p.
+void sweepCoarse( Field3 &C, Field3 &tmp, const CoarseOperators &ops, size_t l, double p,
+                  size_t nSteps, size_t nthreads)
+{
+    const std::vector<int> &rs = ops.H.rowStarts(l);
+    const std::vector<int> &cols = ops.H.columns(l);
+    const std::vector<float> &vals = ops.vals[l-1];
+    std::vector<float> scale( C.rows());
+    for ( size_t i = 0; i < scale.size(); ++i)
+    {
+        const float rsum = ops.rowSums[l-1][i];
+        scale[i] = rsum > 0.0f ? float( std::pow( double(rsum), p - 1.0)) : 1.0f;
+    }   // end for
+
+    for ( size_t it = 0; it < nSteps; ++it)
+    {
+        parallelFor( C.rows(), nthreads, [&]( size_t b, size_t e)
+        {
+            for ( size_t i = b; i < e; ++i)
+            {
+                Eigen::Matrix<float, 1, 3> v = Eigen::Matrix<float, 1, 3>::Zero();
+                for ( int j = rs[i]; j < rs[i+1]; ++j)
+                    v += vals[j] * C.row(cols[j]);
+                tmp.row(i) = scale[i] * v;
+            }   // end for
+        }, 512);
+        C.swap( tmp);
+    }   // end for
+}   // end sweepCoarse
+
+
+// Approximate m sweeps of the template's operator over the field C on coarse level l by sweeps
+// of the level's operator, doing most of them on the next coarser level if there is one and it
+// needs any (VCYCLE_SWEEPS are done on level l either side of relaxing the restricted field).
+void vcycle( Field3 &C, const CoarseOperators &ops, size_t l, double m, size_t nthreads)
+{
+    const size_t n = ops.sweeps( l, m);
+    if ( n == 0)
+        return;
+    Field3 tmp( C.rows(), 3);
+    const double mc = m - 2 * VCYCLE_SWEEPS * ops.sweepsPer[l];
+    if ( l + 1 == ops.H.numLevels() || n <= 2*VCYCLE_SWEEPS || ops.sweeps( l+1, mc) == 0)
+    {
+        sweepCoarse( C, tmp, ops, l, m / double(n), n, nthreads);
+        return;
+    }   // end if
+
+    sweepCoarse( C, tmp, ops, l, ops.sweepsPer[l], VCYCLE_SWEEPS, nthreads);
+    Field3 D = restrictField( ops.H, l+1, C);
+    const Field3 D0 = D;
+    vcycle( D, ops, l+1, mc, nthreads);
+    prolongAdd( ops.H, l+1, D - D0, C, nthreads);
+    sweepCoarse( C, tmp, ops, l, ops.sweepsPer[l], VCYCLE_SWEEPS, nthreads);
+}   // end vcycle
 
 
 // Outlier diffusion looks at relatively low probability vectors and averages them with their
 // neighbours to diffuse possible error among the neighbours. Higher probabilities are ignored.
-void diffuseOutliers( MatX3f &M,
-                      const SmoothingWeights &swts, const VecXf &iwts, float wthresh, size_t nSteps)
+// Outliers are updated in place in index order unless a colouring is given, in which case they're
+// updated a colour at a time (see NeighbourColouring) with the outliers of each colour split over
+// threads, so results are the same for any number of threads (though not the same as updating
+// them in index order).
+template <size_t FK, typename W>
+void diffuseOutliers( MatX3f &M, const W &swts, const NeighbourColouring *colouring,
+                      const VecXf &iwts, float wthresh, size_t nSteps,
+                      ViscoElasticTransformer::Workspace &ws, size_t nthreads)
 {
-    // Identify outliers as those with weights lower than threshold
-    int N = int(M.rows());
-    std::vector<int> outliers;
-    outliers.reserve(N);
-    for ( int i = 0; i < N; ++i)
-        if ( iwts[i] < wthresh)
-            outliers.push_back(i);
-    N = int(outliers.size());
-
-    const size_t K = swts.indices().cols();
+    // Identify outliers as those with weights lower than threshold (grouped by colour if coloured)
+    std::vector<int> &outliers = ws.outliers;
+    std::vector<int> &ostarts = ws.ostarts;
+    outliers.clear();
+    ostarts.assign( 1, 0);
+    outliers.reserve( M.rows());
+    if ( colouring)
+    {
+        const std::vector<int> &order = colouring->order();
+        const std::vector<int> &cstarts = colouring->colourStarts();
+        for ( size_t c = 0; c < colouring->numColours(); ++c)
+        {
+            for ( int j = cstarts[c]; j < cstarts[c+1]; ++j)
+                if ( iwts[order[j]] < wthresh)
+                    outliers.push_back( order[j]);
+            ostarts.push_back( int(outliers.size()));
+        }   // end for
+    }   // end if
+    else
+    {
+        for ( int i = 0; i < int(M.rows()); ++i)
+            if ( iwts[i] < wthresh)
+                outliers.push_back(i);
+        ostarts.push_back( int(outliers.size()));
+    }   // end else
+    const int N = int(outliers.size());
+    const size_t ngroups = ostarts.size() - 1;
 
     // Calculate sum of weights over all neighbours of each outlier
-    VecXf wsums = VecXf::Zero( N);
+    VecXf &wsums = ws.owsums;
+    wsums.setZero( N);
+    auto rows = neighbourRows<FK>( swts);
     for ( int i = 0; i < N; ++i)
     {
-        const int l = outliers[i];
-        for ( size_t k = 0; k < K; ++k)
-            wsums[i] += swts.weights()(l,k);
+        const int *nidxs;
+        const float *swt;
+        rows.get( outliers[i], nidxs, swt);
+        for ( size_t k = 0; k < rows.K; ++k)
+            wsums[i] += swt[k];
     }   // end for
 
     for ( size_t s = 0; s < nSteps; ++s)
@@ -105,22 +580,33 @@ void diffuseOutliers( MatX3f &M,
         // so this is removed.
         //const MatX3f tmpM = M;
 
-        for ( int i = 0; i < N; ++i)
+        for ( size_t c = 0; c < ngroups; ++c)
         {
-            const int l = outliers[i];
-            Vec3f vavg = Vec3f::Zero();
-            for ( size_t k = 0; k < K; ++k)
+            const int cb = ostarts[c];
+            parallelFor( size_t(ostarts[c+1] - cb), nthreads, [&]( size_t b, size_t e)
             {
-                const float wt = swts.weights()(l,k);
-                //vavg += wt * tmpM.row( swts.indices()(l,k));
-                vavg += wt * M.row( swts.indices()(l,k));
-            }   // end for
+                auto crows = neighbourRows<FK>( swts);
+                for ( int i = cb + int(b); i < cb + int(e); ++i)
+                {
+                    const int l = outliers[i];
+                    const int *nidxs;
+                    const float *swt;
+                    crows.get( l, nidxs, swt);
+                    Vec3f vavg = Vec3f::Zero();
+                    for ( size_t k = 0; k < crows.K; ++k)
+                    {
+                        const float wt = swt[k];
+                        //vavg += wt * tmpM.row( nidxs[k]);
+                        vavg += wt * M.row( nidxs[k]);
+                    }   // end for
 
-            // The amount of the neighbouring vector directions added is in
-            // proportion to the uncertainty about the direction of this vector.
-            const float iw = iwts[l];
-            M.row(l) *= iw;
-            M.row(l) += (1.0f - iw) * vavg / wsums[i];
+                    // The amount of the neighbouring vector directions added is in
+                    // proportion to the uncertainty about the direction of this vector.
+                    const float iw = iwts[l];
+                    M.row(l) *= iw;
+                    M.row(l) += (1.0f - iw) * vavg / wsums[i];
+                }   // end for
+            }, 64);
         }   // end for
     }   // end for
 }   // end diffuseOutliers
@@ -131,40 +617,234 @@ void diffuseOutliers( MatX3f &M,
 ViscoElasticTransformer::ViscoElasticTransformer( const SmoothingWeights &swts,
                                                   size_t nvs, size_t nve,
                                                   size_t nes, size_t nee,
-                                                  size_t numUpdates, float itw, size_t nodi)
-    : _swts(swts),
+                                                  size_t numUpdates, float itw, size_t nodi, size_t nthreads,
+                                                  float smoothTol, const SmoothingHierarchy *hierarchy,
+                                                  const NeighbourColouring *colouring, Workspace *workspace)
+    : _swts(&swts),
+      _cw(nullptr),
+      _stw(nullptr),
       _viscousAnnealingRate( std::exp( std::log( float(nve)/float(nvs)) / numUpdates)),
       _elasticAnnealingRate( std::exp( std::log( float(nee)/float(nes)) / numUpdates)),
       _numViscousStart( nvs),
       _numElasticStart( nes),
       _inlierThresholdWt( itw),
       _numOutlierDiffIts(nodi),
+      _nthreads(nthreads),
+      _smoothTol(smoothTol),
+      _hierarchy(hierarchy),
+      _symKernel( smoothTol > 0.0f ? symmetricKernel( swts, swts.indices().rows(), nthreads) : RowMatXf()),
+      _ownColouring( colouring || nthreads <= 1 ? nullptr : new NeighbourColouring( swts)),
+      _colouring( nthreads <= 1 ? nullptr : colouring ? colouring : _ownColouring.get()),
+      _ownWorkspace( workspace ? nullptr : new Workspace),
+      _ws( workspace ? workspace : _ownWorkspace.get()),
+      _measureErr(false),
+      _approxErr(0.0f),
       _field( MatX3f::Zero( swts.indices().rows(), 3)), // total displacement field
       _i(0.0f)
+{
+    assert( !hierarchy || hierarchy->size(0) == size_t(swts.indices().rows()));
+    assert( !_colouring || _colouring->colours().size() == size_t(swts.indices().rows()));
+}   // end ctor
+
+
+ViscoElasticTransformer::ViscoElasticTransformer( const CompactWeights &cwts,
+                                                  size_t nvs, size_t nve,
+                                                  size_t nes, size_t nee,
+                                                  size_t numUpdates, float itw, size_t nodi, size_t nthreads,
+                                                  float smoothTol, const SmoothingHierarchy *hierarchy,
+                                                  const NeighbourColouring *colouring, Workspace *workspace)
+    : _swts(nullptr),
+      _cw(&cwts),
+      _stw(nullptr),
+      _viscousAnnealingRate( std::exp( std::log( float(nve)/float(nvs)) / numUpdates)),
+      _elasticAnnealingRate( std::exp( std::log( float(nee)/float(nes)) / numUpdates)),
+      _numViscousStart( nvs),
+      _numElasticStart( nes),
+      _inlierThresholdWt( itw),
+      _numOutlierDiffIts(nodi),
+      _nthreads(nthreads),
+      _smoothTol(smoothTol),
+      _hierarchy(hierarchy),
+      _symKernel( smoothTol > 0.0f ? symmetricKernel( cwts, cwts.rows(), nthreads) : RowMatXf()),
+      _ownColouring( colouring || nthreads <= 1 ? nullptr : new NeighbourColouring( cwts)),
+      _colouring( nthreads <= 1 ? nullptr : colouring ? colouring : _ownColouring.get()),
+      _ownWorkspace( workspace ? nullptr : new Workspace),
+      _ws( workspace ? workspace : _ownWorkspace.get()),
+      _measureErr(false),
+      _approxErr(0.0f),
+      _field( MatX3f::Zero( cwts.rows(), 3)),
+      _i(0.0f)
+{
+    assert( !hierarchy || hierarchy->size(0) == cwts.rows());
+    assert( !_colouring || _colouring->colours().size() == cwts.rows());
+}   // end ctor
+
+
+ViscoElasticTransformer::ViscoElasticTransformer( const StreamedWeights &swts,
+                                                  size_t nvs, size_t nve,
+                                                  size_t nes, size_t nee,
+                                                  size_t numUpdates, float itw, size_t nodi, size_t nthreads,
+                                                  const NeighbourColouring *colouring, Workspace *workspace)
+    : _swts(nullptr),
+      _cw(nullptr),
+      _stw(&swts),
+      _viscousAnnealingRate( std::exp( std::log( float(nve)/float(nvs)) / numUpdates)),
+      _elasticAnnealingRate( std::exp( std::log( float(nee)/float(nes)) / numUpdates)),
+      _numViscousStart( nvs),
+      _numElasticStart( nes),
+      _inlierThresholdWt( itw),
+      _numOutlierDiffIts(nodi),
+      _nthreads(nthreads),
+      _smoothTol(0.0f),
+      _hierarchy(nullptr),
+      _ownColouring( colouring || nthreads <= 1 ? nullptr : new NeighbourColouring( swts)),
+      _colouring( nthreads <= 1 ? nullptr : colouring ? colouring : _ownColouring.get()),
+      _ownWorkspace( workspace ? nullptr : new Workspace),
+      _ws( workspace ? workspace : _ownWorkspace.get()),
+      _measureErr(false),
+      _approxErr(0.0f),
+      _field( MatX3f::Zero( swts.rows(), 3)),
+      _i(0.0f)
 {
 }   // end ctor
 
 
 void ViscoElasticTransformer::update( MatX3f &df, const VecXf &iwts)
 {
-    assert( df.rows() == int(_swts.indices().rows()));
+    assert( df.rows() == _field.rows());
     assert( df.rows() == iwts.size());
 
-    const MatXf wts = createWeights( _swts, iwts);
-    const VecXf wRowSums = wts.rowwise().sum();
-
-    // Regularise given displacement field prior to adding to total displacement
     const size_t nVs = size_t( _numViscousStart * std::pow( _viscousAnnealingRate, _i));
-    regularise( df, wts, wRowSums, _swts.indices(), nVs);
-    const MatX3f pfield = _field;   // Copy prior field
-    _field += df;
-
-    // Regularise/relax the TOTAL deformation field
     const size_t nEs = size_t( _numElasticStart * std::pow( _elasticAnnealingRate, _i));
-    regularise( _field, wts, wRowSums, _swts.indices(), nEs);
-    diffuseOutliers( _field, _swts, iwts, _inlierThresholdWt, _numOutlierDiffIts);
+    Workspace &ws = *_ws;
+    MatX3f &pfield = ws.prior;
+    pfield = _field;   // Copy prior field
+    _approxErr = 0.0f;
+
+    // Calls fn with the source of the neighbours and weights.
+    const auto withRows = [this]( auto &&fn)
+    {
+        if ( _cw)
+            fn( *_cw);
+        else if ( _stw)
+            fn( *_stw);
+        else
+            fn( *_swts);
+    };  // end withRows
+
+    const size_t numCols = _cw ? _cw->cols() : _stw ? _stw->cols() : size_t(_swts->indices().cols());
+    dispatchK( numCols, [&]( auto fk)
+    {
+        constexpr size_t K = decltype(fk)::value;
+        VecXf &mwts = ws.mwts;
+        VecXf &wsums = ws.wsums;
+        mwts = (1.0f - WEIGHT_EPS) * iwts;
+        withRows( [&]( const auto &w){ weightSums<K>( w, mwts, wsums, _nthreads);});
+        Field4 &M = ws.M, &tmp = ws.tmp;
+        M.resize( df.rows(), 4);
+        tmp.resize( df.rows(), 4);
+        M.col(3) = mwts;
+        const auto sweep = [&]( size_t n)
+        {
+            withRows( [&]( const auto &w){ regularise<K>( M, tmp, w, wsums, n, _nthreads);});
+        };  // end sweep
+
+        // Apply n sweeps exactly or approximate them with a V-cycle through the hierarchy if given,
+        // or with fewer applications of the smoothing operator if a tolerance is set and a lower
+        // degree meets it, returning whether approximated. The operator and its coarse counterparts
+        // are only built if needed.
+        RowMatXf &A = ws.A, &As = ws.As;
+        bool haveA = false, haveAs = false;
+        const auto buildA = [&]()
+        {
+            if ( !haveA)
+                withRows( [&]( const auto &w){ operatorWeights<K>( w, mwts, wsums, A, _nthreads);});
+            haveA = true;
+        };  // end buildA
+        std::unique_ptr<CoarseOperators> ops;
+        const auto approximate = [&]( size_t n)
+        {
+            if ( _hierarchy && _hierarchy->numLevels() > 1 && n > 2*VCYCLE_SWEEPS)
+            {
+                buildA();
+                if ( !ops)
+                    withRows( [&]( const auto &w){ ops.reset( new CoarseOperators( *_hierarchy, w, A));});
+                const double mc = double(n - 2*VCYCLE_SWEEPS);
+                if ( ops->sweeps( 1, mc) > 0)
+                {
+                    sweep( VCYCLE_SWEEPS);
+                    Field3 D = restrictField( *_hierarchy, 1, M);
+                    const Field3 D0 = D;
+                    vcycle( D, *ops, 1, mc, _nthreads);
+                    prolongAdd( *_hierarchy, 1, D - D0, M, _nthreads);
+                    sweep( VCYCLE_SWEEPS);
+                    return true;
+                }   // end if
+            }   // end if
+
+            if ( _smoothTol > 0.0f && n > 0)
+            {
+                // The symmetrised operator is applied (exactly if d == n) so the truncation error holds.
+                if ( !haveAs)
+                    withRows( [&]( const auto &w){ symmetricOperatorWeights<K>( w, _symKernel, mwts, wsums, As, _nthreads);});
+                haveAs = true;
+                const size_t d = powerDegree( n, _smoothTol);
+                withRows( [&]( const auto &w){ chebyshevPower<K>( M, w, As, powerCoeffs( n, d), ws, _nthreads);});
+                if ( !_measureErr)
+                    _approxErr = std::max( _approxErr, float( powerError( n, d)));
+                return true;
+            }   // end if
+
+            sweep( n);
+            return false;
+        };  // end approximate
+
+        // If measuring, the exact sweeps are also applied to a copy of the field to compare with.
+        const auto relax = [&]( size_t n)
+        {
+            if ( !_measureErr)
+            {
+                approximate( n);
+                return;
+            }   // end if
+            Field4 &E = ws.exact;
+            E = M;
+            if ( !approximate( n))
+                return;
+            const float norm0 = E.leftCols<3>().norm();
+            withRows( [&]( const auto &w){ regularise<K>( E, tmp, w, wsums, n, _nthreads);});
+            if ( norm0 > 0.0f)
+                _approxErr = std::max( _approxErr, (M.leftCols<3>() - E.leftCols<3>()).norm() / norm0);
+        };  // end relax
+
+        // Regularise given displacement field prior to adding to total displacement
+        M.leftCols<3>() = df;
+        relax( nVs);
+        _field += M.leftCols<3>();
+
+        // Regularise/relax the TOTAL deformation field
+        M.leftCols<3>() = _field;
+        relax( nEs);
+        _field = M.leftCols<3>();
+        withRows( [&]( const auto &w)
+        {
+            diffuseOutliers<K>( _field, w, _colouring, iwts, _inlierThresholdWt, _numOutlierDiffIts, ws, _nthreads);
+        });
+    });
     _i += 1.0f;
 
     df = _field - pfield;   // Set the difference in the deformation field
 }   // end update
 
+
+
+float ViscoElasticTransformer::powerApproxError( size_t n, size_t degree)
+{
+    return float( powerError( n, degree));
+}   // end powerApproxError
+
+
+size_t ViscoElasticTransformer::powerApproxDegree( size_t n, float tol)
+{
+    return tol > 0.0f ? powerDegree( n, tol) : n;
+}   // end powerApproxDegree